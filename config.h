@@ -10,8 +10,18 @@ u32 const TCS_NUM = 3;
 char const FONT_NAME[] = "monospace:size=10";
 // lag prevention. only one drag event per period will be done
 u32 const DRAG_PERIOD_US = 10000;
+// redraws are coalesced to not exceed this rate
+u32 const MAX_FPS = 120;
 i32 const PNG_DEFAULT_COMPRESSION = 8;
 i32 const JPG_DEFAULT_QUALITY = 80;
+// canvas rows converted and passed to encoder at once when saving
+u32 const EXPORT_BATCH_ROWS = 16;
+// undo history memory limit, oldest entries are dropped beyond it
+u32 const HISTORY_BUDGET_MB = 512;
+// recently used history entries kept in memory, others go to spill file
+u32 const HISTORY_RESIDENT = 8;
+// nonzero logs operations instead of pixels, full copy every this many actions
+u32 const HISTORY_OPS_INTERVAL = 0;
 
 XRenderColor const SCHEMES[SchmLast][2] = {
     // fg, bg (rgba premultiplied)
@@ -74,8 +84,12 @@ struct {
 
 struct {
     u32 default_line_w;
+    u32 default_fill_tol;  // 0 fills exactly matching color only
+    Bool figure_antialias;  // smooth edges of circle figures
 } const TOOLS = {
     .default_line_w = 5,
+    .default_fill_tol = 0,
+    .figure_antialias = True,
 };
 
 struct {
@@ -12,7 +12,7 @@ CLANGTIDY ?= clang-tidy
 
 # compiler and linker flags
 INCS = -I/usr/X11R6/include -I/usr/include/freetype2
-LIBS = -L/usr/X11R6/lib -lX11 -lX11 -lm -lXext -lXft -lXrender
+LIBS = -L/usr/X11R6/lib -lX11 -lX11 -lm -lXext -lXft -lXrender -lpng -ljpeg
 DEFINES = -DVERSION=\"$(VERSION)\" \
 	$(foreach res, \
 		$(wildcard $(RES)/*), \
@@ -4,5 +4,6 @@ pkgs.mkShell {
   nativeBuildInputs = with pkgs; [
     gnumake util-linux
     xorg.libX11 xorg.libXext xorg.libXft
+    libpng libjpeg
   ];
 }
@@ -21,6 +21,11 @@ typedef struct {
     i32 y;
 } Pair;
 
+typedef struct {
+    Pair lt;  // inclusive
+    Pair rb;  // exclusive
+} Rect;
+
 enum Schm {
     SchmNorm,
     SchmFocus,
@@ -1,9 +1,12 @@
+#define _POSIX_C_SOURCE 200112L  // posix_fallocate
+
 #include <X11/X.h>
 #include <X11/Xatom.h>  // XA_*
 #include <X11/Xft/Xft.h>
 #include <X11/Xft/XftCompat.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>  // shared memory images
 #include <X11/extensions/Xdbe.h>  // back buffer
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/render.h>
@@ -11,15 +14,26 @@
 #include <ctype.h>
 #include <limits.h>
 #include <math.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
+#include <sys/ipc.h>
 #include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/shm.h>
 #include <sys/time.h>
 #include <sys/unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>  // span fill, blending
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BLEND_AVX2  // compiled with target attribute, chosen at runtime
+#include <immintrin.h>
+#endif
 
 // libs
 #define INCBIN_PREFIX
@@ -34,6 +48,8 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "lib/stb_image_write.h"
 #undef STB_IMAGE_WRITE_IMPLEMENTATION
+#include <jpeglib.h>  // row by row export
+#include <png.h>
 
 #include "config.h"
 #include "types.h"
@@ -87,6 +103,27 @@ INCBIN(u8, pic_unknown, "res/unknown.png");
      && (p_tc)->d.sel.drag_from.y != NIL)
 #define UNREACHABLE() __builtin_unreachable()
 #define ZOOM_C(dc_p)  (pow(ZOOM_SPEED, (double)(dc_p)->cv.zoom))
+// raster tile side is 2^TILE_SIZE_LOG2 pixels
+#define TILE_SIZE_LOG2 8
+#define TILE_SIZE      (1 << TILE_SIZE_LOG2)
+#define TILE_MASK      (TILE_SIZE - 1)
+#define TILE_PX        (TILE_SIZE * TILE_SIZE)
+// tiles uploaded through shared memory per ShmCompletion, rest of
+// frame goes through plain XPutImage
+#define SHM_STAGING_TILES 16
+// canvas downscaled by 2 per level, level 0 is canvas itself
+#define MIP_LEVELS 6
+// canvas pixels uploaded around the visible area
+#define VIEWPORT_MARGIN 2
+// antialiased ellipse subrows per pixel row
+#define ELLIPSE_AA_SAMPLES 4
+// fractional bits of ellipse span edges
+#define ELLIPSE_FRAC_BITS 12
+// fractional bits of polygon vertices
+#define SUBPX_BITS 4
+#define SUBPX      (1 << SUBPX_BITS)
+// brush stroke alpha lookup steps per squared pixel distance
+#define STROKE_LUT_SCALE 4
 
 enum {
     A_Clipboard,
@@ -117,11 +154,31 @@ enum ImageType {
     IMT_Unknown,
 };
 
+// image split into square tiles, pixels accessed via raster_* functions
+struct Raster {
+    u32 w;  // in pixels
+    u32 h;
+    u32 tw;  // in tiles
+    u32 th;
+    argb empty;  // color of tiles without pixel data
+    struct Raster const* base;  // if set, tiles start as its copy on write
+    struct History* rec;  // if set, tiles are recorded before first write
+    struct Tile {
+        // TILE_SIZE rows of TILE_SIZE pixels, NULL if empty. shared with
+        // history entries by reference count, copied on write when shared
+        argb* px;
+        u32 gen;  // new value on each write access, copied with pixels
+        Bool dirty;  // changed since last upload to screen cache
+    }* tiles;  // row-major, tw * th
+};
+
 struct Ctx;
 struct DrawCtx;
 struct ToolCtx;
+struct History;
 
 typedef void (*draw_fn)(struct Ctx* ctx, Pair p);
+typedef void (*stroke_fn)(struct Ctx* ctx, Pair from, Pair to);
 
 typedef u8 (*circle_get_alpha_fn)(
     struct Ctx* ctx,
@@ -143,27 +200,68 @@ struct Ctx {
         u32 width;
         u32 height;
         XdbeBackBuffer back_buffer;  // double buffering
+        // destination of draw_* functions, back buffer by default
+        struct DrawTarget {
+            Drawable d;
+            XftDraw* xft;  // bound to d
+        } target;
+        struct Statusline {
+            Pixmap pm;  // rendered statusline, copied to each frame
+            XftDraw* xft;  // bound to pm
+            u32 w;
+            u32 h;
+            char* state_dyn;  // state pm was rendered for, NULL if invalid
+        } sl;
         i32 png_compression_level;  // FIXME find better place
         i32 jpg_quality_level;  // FIXME find better place
         struct Canvas {
-            XImage* im;
+            struct Raster rs;
             enum ImageType type;
             i32 zoom;  // 0 == no zoom
             Pair scroll;
+            // lazily built for zoomed out rendering, mips[i] is level i + 1
+            struct Mip {
+                struct Raster rs;
+                u32 (*src_gens)[4];  // gens of 2x2 source tiles built from
+            } mips[MIP_LEVELS - 1];
+            // figure preview composited over rs, written tiles are copies
+            // of rs tiles, others transparent; no tiles if not previewing
+            struct Raster overlay;
         } cv;
         struct Fnt {
             XftFont* xfont;
             u32 h;
+            struct {
+                char* key;
+                u32 value;
+            }* widths_hm;  // text extents memo, valid for xfont only
         } fnt;
         struct Scheme {
             XftColor fg;
             XftColor bg;
         }* schemes_dyn;  // must be len of SchmLast
         struct Cache {
-            u32 pm_w;  // to validate pm
-            u32 pm_h;
-            Pixmap pm;  // pixel buffer to update screen
+            // per mip level, allocated when level is first shown
+            struct CacheLevel {
+                u32 pm_w;  // to validate pm
+                u32 pm_h;
+                Pixmap pm;  // pixel buffer to update screen
+                Picture src_pict;  // bound to pm, recreated with it
+                i32 pict_zoom;  // zoom value src_pict transform made for
+                Bool pict_zoom_valid;
+            } levels[MIP_LEVELS];
+            struct CacheLevel overlay;  // of cv.overlay
+            Picture dst_pict;  // bound to back_buffer
+            XImage* tile_im;  // header to upload tile pixels, has no data
         } cache;
+        struct Shm {
+            Bool enabled;  // MIT-SHM usable with this display
+            i32 completion_ev;  // ShmCompletion event type, NIL if disabled
+            Bool put_pending;  // server still reads staging memory
+            // SHM_STAGING_TILES tiles stacked vertically
+            XImage* staging;
+            XShmSegmentInfo seg;
+        } shm;
     } dc;
 
     struct Input {
@@ -192,6 +290,34 @@ struct Ctx {
         } d;
     } input;
 
+    struct Frame {
+        Bool pending;  // view changed since last rendered frame
+        u64 last_us;  // when last frame was rendered
+    } frame;
+
+    // alpha mask of last canvas_circle, rebuilt when key changes
+    struct Stamp {
+        u32 d;  // key
+        circle_get_alpha_fn get_a;  // key, must not depend on ctx state
+        u8* alpha_dyn;  // d rows of d pixels
+        struct StampRow {
+            i32 l;  // pixels of row inside circle, [l, r)
+            i32 r;
+        }* rows_dyn;
+    } stamp;
+
+    // brush coverage of current stroke, overlapping segments take max alpha
+    struct Stroke {
+        u32 tw;  // canvas tiles when stroke began
+        u32 th;
+        struct StrokeTile {
+            u8* cov_dyn;  // max alpha applied to each pixel, NULL if untouched
+            argb* orig_dyn;  // pixels before stroke
+        }* tiles_dyn;
+        u32 lut_d;  // key
+        u8* lut_dyn;  // alpha by STROKE_LUT_SCALE * squared center distance
+    } stroke;
+
     struct ToolCtx {
         void (*on_press)(struct Ctx*, XButtonPressedEvent const*);
         void (*on_release)(struct Ctx*, XButtonReleasedEvent const*);
@@ -203,6 +329,7 @@ struct Ctx {
             u32 curr_col;
             u32 prev_col;
             u32 line_w;
+            u32 fill_tol;  // max channel difference flood fill accepts
             Pair anchor;
         } sdata;
 
@@ -223,7 +350,8 @@ struct Ctx {
             } sel;
             // Tool_Pencil | Tool_Brush
             struct DrawerData {
-                draw_fn fn;
+                draw_fn fn;  // single point
+                stroke_fn stroke;  // segment between points
             } drawer;
             struct FigureData {
                 enum FigureType {
@@ -237,9 +365,91 @@ struct Ctx {
     }* tcarr;
     u32 curr_tc;
 
+    // canvas tiles changed by one action, as they were before it; applying
+    // swaps them with canvas, so same entry then redoes the action
     struct History {
-        XImage* im;
-    } *hist_prevarr, *hist_nextarr;
+        u32 w;  // canvas size and empty color tiles belong to
+        u32 h;
+        argb empty;
+        struct HistTile {
+            u32 idx;  // in canvas tile grid
+            argb* px;  // NULL for empty or compressed tile
+            u32* rle_dyn;  // run length and color pairs, NULL if uncompressed
+            u32 rle_len;  // u32 items in rle_dyn
+            usize spill_off;  // SIZE_MAX if tile has no data in spill file
+            Bool deferred;  // skipped while shared with canvas
+        }* tiles_arr;  // every tile of grid if size or empty color differ
+        u8* recorded_dyn;  // bit per tile, only while recording
+        Bool whole;  // every tile recorded, grid may have changed since
+        Bool track_only;  // only notes changed tiles, pixels aren't kept
+        u32 packed;  // leading tiles already visited by compression
+        Bool spilled;  // tile data moved to spill file
+        u32 deferred;  // tiles to pack or spill once canvas drops them
+        u64 used;  // hist_clock at last use
+    } *hist_prevarr, *hist_nextarr, hist_curr;
+    u32 hist_budget_mb;  // oldest entries are dropped above it
+    u32 hist_resident;  // entries kept in memory, least recently used spill
+    u64 hist_clock;
+    u32 hist_unshares;  // tile_unshares when deferred tiles were checked
+
+    // unlinked scratch file holding spilled history tiles
+    struct Spill {
+        i32 fd;  // -1 until first spill
+        u8* map;
+        usize size;  // of file and mapping
+        usize top;  // everything above is unused
+        struct Extent {
+            usize off;
+            usize len;
+        }* free_arr;  // released extents below top, sorted by offset
+        Bool failed;  // not retried until history changes or space frees
+    } spill;
+
+    // alternative to tile history, keeps replayable canvas operations of
+    // actions. undo restores nearest checkpoint and replays actions after it
+    struct OpLog {
+        u32 interval;  // actions between checkpoints, 0 if log is disabled
+        struct Action {
+            // plain data, can be stored as is
+            struct Op {
+                enum OpTag {
+                    Op_Dot,
+                    Op_Segment,
+                    Op_Figure,
+                    Op_Fill,
+                    Op_Copy,
+                } t;
+                argb col;
+                u32 line_w;
+                union OpData {
+                    // Op_Dot | Op_Segment
+                    struct OpDDraw {
+                        Pair from, to;  // same for Op_Dot
+                        Bool soft;  // brush, pencil otherwise
+                    } draw;
+                    struct OpDFigure {
+                        struct FigureData fig;
+                        Pair p1, p2;
+                    } figure;
+                    struct OpDFill {
+                        Pair seed;
+                        u32 tol;
+                    } fill;
+                    struct OpDCopy {
+                        Pair from, dims, to;
+                        Bool clear_source;
+                    } copy;
+                } d;
+            }* ops_arr;
+            Bool opaque;  // can't be replayed, checkpoint follows it
+        }* actions_arr;  // undone ones are kept until next action
+        u32 pos;  // actions applied to canvas
+        struct Checkpoint {
+            u32 pos;  // actions applied before it
+            struct History hist;  // every tile, shared with canvas
+        }* checkpoints_arr;  // ascending pos, first is at 0
+        struct Op* curr_arr;  // ops of action being recorded
+    } oplog;
 
     struct SelectionCircle {
         Bool is_active;
@@ -250,6 +460,14 @@ struct Ctx {
             void (*on_select)(struct Ctx*);
             enum Icon icon;
         }* items;
+        // prerendered at init, circle center is at (r, r)
+        u32 r;
+        Pixmap base_pm;  // items with icons
+        Pixmap focus_pm;  // all items highlighted
+        Pixmap mask;  // circle shape
+        Pixmap* item_masks_dyn;  // segment shapes
+        Bool is_shown;  // drawn on window since last frame swap
+        i32 shown_item;
     } sc;
 
     struct SelectionBuffer {
@@ -280,6 +498,10 @@ struct ClCommand {
                 ClCDS_FOut,
                 ClCDS_PngCompression,
                 ClCDS_JpgQuality,
+                ClCDS_FillTol,
+                ClCDS_HistBudget,
+                ClCDS_HistResident,
+                ClCDS_HistOps,
                 ClCDS_Last,
             } t;
             union ClCDSData {
@@ -304,6 +526,18 @@ struct ClCommand {
                 struct ClCDSDJpgQlt {
                     i32 quality;
                 } jpg_qlt;
+                struct ClCDSDFillTol {
+                    u32 value;
+                } fill_tol;
+                struct ClCDSDHistBudget {
+                    u32 mb;
+                } hist_budget;
+                struct ClCDSDHistResident {
+                    u32 value;
+                } hist_resident;
+                struct ClCDSDHistOps {
+                    u32 interval;
+                } hist_ops;
             } d;
         } set;
         struct ClCDEcho {
@@ -387,11 +621,30 @@ static Pair point_from_scr_to_cv_xy(struct DrawCtx const* dc, i32 x, i32 y);
 static Bool point_in_rect(Pair p, Pair a1, Pair a2);
 
 static enum ImageType file_type(char const* file_path);
+static Bool ximage_is_argb32(XImage const* im);
+static argb* ximage_row(XImage const* im, i32 y);
 static u8* ximage_to_rgb(XImage const* image, Bool rgba);
 static argb blend_background(argb fg, argb bg, u32 a);
+static void blend_init(void);
+static void blend_row(argb* dst, u8 const* alpha, u32 len, argb col);
+static void blend_row_scalar(argb* dst, u8 const* alpha, u32 len, argb col);
+static void blend_flatten(argb* px, u32 len, argb bg);
+static void blend_flatten_scalar(argb* px, u32 len, argb bg);
+#ifdef __SSE2__
+static void blend_row_sse2(argb* dst, u8 const* alpha, u32 len, argb col);
+static void blend_flatten_sse2(argb* px, u32 len, argb bg);
+#endif
+#ifdef BLEND_AVX2
+static void blend_row_avx2(argb* dst, u8 const* alpha, u32 len, argb col);
+static void blend_flatten_avx2(argb* px, u32 len, argb bg);
+#endif
+static void pixels_fill(argb* dst, u32 len, argb col);
+static void pixels_to_rgba(u8* dst, argb const* src, u32 len);
 static XImage* read_file_from_memory(struct DrawCtx const* dc, u8 const* data, u32 len, argb bg);
 static XImage* read_file_from_path(struct DrawCtx const* dc, char const* file_name, argb bg);
 static Bool save_file(struct DrawCtx* dc, enum ImageType type, char const* file_path);
+static Bool save_png(struct Raster const* rs, FILE* file, i32 level);
+static Bool save_jpg(struct Raster const* rs, FILE* file, i32 quality);
 
 static ClCPrcResult cl_cmd_process(struct Ctx* ctx, struct ClCommand const* cl_cmd);
 static ClCPrsResult cl_cmd_parse(struct Ctx* ctx, char const* cl);
@@ -410,7 +663,7 @@ static void cl_pop(struct InputConsoleData* cl);
 static void input_state_set(struct Input* input, enum InputTag is);
 
 static void sel_circ_init(struct Ctx* ctx, i32 x, i32 y);
-static void sel_circ_free(struct SelectionCircle* sel_circ);
+static void sel_circ_free(Display* dp, struct SelectionCircle* sel_circ);
 static i32 sel_circ_curr_item(struct SelectionCircle const* sc, i32 x, i32 y);
 
 // separate functions, because they are callbacks
@@ -426,27 +679,86 @@ static void tool_fill_on_release(struct Ctx* ctx, XButtonReleasedEvent const* ev
 static void tool_picker_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
 
 static Bool history_move(struct Ctx* ctx, Bool forward);
-static void history_push(struct History** hist, struct Ctx* ctx);
 static void history_forward(struct Ctx* ctx);
+static void history_commit(struct Ctx* ctx);
 static void history_apply(struct Ctx* ctx, struct History* hist);
-static Bool history_restore(struct Ctx* ctx);
-static struct History history_clone(struct History const* hist);
-static void historyarr_clear(Display* dp, struct History** hist);
-
-static Bool ximage_put_checked(XImage* im, u32 x, u32 y, argb col);
+static void history_record_tile(struct History* hist, struct Raster const* rs, u32 idx);
+static void history_record_all(struct History* hist, struct Raster const* rs);
+static void history_free(struct Spill* sp, struct History* hist);
+static void historyarr_clear(struct Spill* sp, struct History** hist);
+static Bool history_idle_step(struct Ctx* ctx);
+static Bool history_spill(struct Spill* sp, struct History* hist, struct Raster const* rs);
+static void history_spill_tile(struct Spill* sp, struct History const* hist, struct HistTile* ht, struct Raster const* rs);
+static void history_unspill(struct Spill* sp, struct History* hist);
+static usize history_tile_len(struct HistTile const* ht);
+static Bool spill_open(struct Spill* sp);
+static Bool spill_alloc(struct Spill* sp, usize len, usize* off);
+static void spill_release(struct Spill* sp, usize off, usize len);
+static usize spill_usage(struct Spill const* sp);
+static void spill_close(struct Spill* sp);
+static Bool history_tile_on_canvas(struct History const* hist, struct HistTile const* ht, struct Raster const* rs);
+static Bool history_tile_pack(struct History const* hist, struct HistTile* ht, struct Raster const* rs);
+static void history_tile_unpack(struct HistTile* ht);
+static usize history_usage(struct Ctx const* ctx);
+static void history_evict(struct Ctx* ctx);
+static void op_do(struct Ctx* ctx, struct Op const* op);
+static void op_run(struct Ctx* ctx, struct Op const* op);
+static void oplog_commit(struct Ctx* ctx, Bool opaque);
+static void oplog_checkpoint(struct Ctx* ctx);
+static void oplog_restore(struct Ctx* ctx, struct History const* cp);
+static Bool oplog_move(struct Ctx* ctx, Bool undo);
+static void oplog_clear(struct OpLog* log);
+
+static argb* tile_px_new(void);
+static argb* tile_px_ref(argb* px);
+static void tile_px_unref(argb* px);
+static u32 tile_px_refs(argb const* px);
+static void raster_init(struct Raster* rs, u32 w, u32 h, argb empty);
+static void raster_free(struct Raster* rs);
+static void raster_from_ximage(struct Raster* rs, XImage const* im);
+static XImage* raster_to_ximage(struct DrawCtx const* dc, struct Raster const* rs, Pair c, Pair dims);
+static argb* raster_tile_w(struct Raster* rs, u32 tx, u32 ty);
+static argb raster_get(struct Raster const* rs, i32 x, i32 y);
+static Bool raster_put(struct Raster* rs, i32 x, i32 y, argb col);
+static argb const* raster_span(struct Raster const* rs, i32 x, i32 y, u32* len);
+static argb* raster_span_w(struct Raster* rs, i32 x, i32 y, u32* len);
+static void raster_read_row(struct Raster const* rs, i32 x, i32 y, u32 len, argb* out);
+static void raster_write_row(struct Raster* rs, i32 x, i32 y, u32 len, argb const* in);
+static void raster_fill_span(struct Raster* rs, i32 x, i32 y, u32 len, argb col);
+static void raster_fill_triangle(struct Raster* rs, Pair const v[3], argb col);
+static void raster_fill(struct Raster* rs, argb col);
+static void raster_resize(struct Raster* rs, u32 w, u32 h);
+static void raster_touch_all(struct Raster* rs);
+static struct Raster* canvas_level(struct Canvas* cv, u32 level);
+static u32 canvas_mip_level(struct DrawCtx const* dc);
+static void canvas_mip_update(struct Canvas* cv, u32 level, Rect r);
+static u8 canvas_brush_get_a(struct Ctx* ctx, double r, Pair p);
 static void canvas_draw_fn_brush(struct Ctx* ctx, Pair c);
 static void canvas_draw_fn_pencil(struct Ctx* ctx, Pair c);
-static void canvas_figure(struct Ctx* ctx, Pair p1, Pair p2);
-static void canvas_fill_rect(struct Ctx* ctx, Pair c, Pair dims, argb col);
-static void canvas_rect(struct Ctx* ctx, Pair c, Pair dims, argb col, u32 w);
-static void canvas_fill_triangle(struct Ctx* ctx, Pair c, Pair dims, argb col);
-static void canvas_triangle(struct Ctx* ctx, Pair c, Pair dims, argb col, u32 w);
-static void canvas_line(struct Ctx* ctx, Pair from, Pair to, draw_fn draw);
+static void canvas_stroke_fn_brush(struct Ctx* ctx, Pair from, Pair to);
+static void canvas_stroke_fn_pencil(struct Ctx* ctx, Pair from, Pair to);
+static void canvas_figure(struct Raster* rs, struct FigureData const* fig, argb col, u32 w, Pair p1, Pair p2);
+static void canvas_fill_rect(struct Raster* rs, Pair c, Pair dims, argb col);
+static void canvas_rect(struct Raster* rs, Pair c, Pair dims, argb col, u32 w);
+static void canvas_fill_triangle(struct Raster* rs, Pair c, Pair dims, argb col);
+static void canvas_triangle(struct Raster* rs, Pair c, Pair dims, argb col, u32 w);
+static void canvas_thick_segment(struct Raster* rs, Pair from, Pair to, argb col, u32 w);
+static void canvas_ellipse(struct Raster* rs, Pair c, Pair r, argb col, u32 w, Bool fill);
+static struct Stamp const* stamp_get(struct Ctx* ctx, u32 d, circle_get_alpha_fn get_a);
+static void stamp_free(struct Stamp* st);
 static void canvas_circle(struct Ctx* ctx, Pair c, u32 d, argb col, circle_get_alpha_fn get_a);
+static void canvas_stroke_square(struct Raster* rs, Pair from, Pair to, u32 w, argb col);
+static void canvas_stroke_soft(struct Ctx* ctx, Pair from, Pair to, u32 d, argb col);
+static u8 const* stroke_lut(struct Stroke* st, u32 d);
+static struct StrokeTile const* stroke_tile(struct Stroke* st, struct Raster const* rs, i32 x, i32 y);
+static void stroke_end(struct Stroke* st);
+static void stroke_free(struct Stroke* st);
 static void canvas_copy_region(struct Ctx* ctx, Pair from, Pair dims, Pair to, Bool clear_source);
 static void canvas_fill(struct Ctx* ctx, argb col);
 static void canvas_load(struct DrawCtx* dc, XImage* im, char const* file_path); // must be void
-static void canvas_free(Display* dp, struct Canvas* cv);
+static void canvas_free(struct Canvas* cv);
+static void overlay_clear(struct Canvas* cv);
+static void overlay_free(struct Canvas* cv);
 static void canvas_change_zoom(struct DrawCtx* dc, Pair cursor, i32 delta);
 static void canvas_resize(struct Ctx* ctx, i32 new_width, i32 new_height);
 
@@ -456,13 +768,25 @@ static void draw_int(struct DrawCtx* dc, i32 i, Pair c, enum Schm sc, Bool inver
 static int fill_rect(struct DrawCtx* dc, Pair p, Pair dim, argb col);
 static int draw_rect(struct DrawCtx* dc, Pair p, Pair dim, argb col, u32 line_w, i32 line_st, i32 cap_st, i32 join_st);
 static int draw_line(struct DrawCtx* dc, Pair from, Pair to, enum Schm sc, Bool invert);
-static u32 get_int_width(struct DrawCtx const* dc, char const* format, u32 i);
-static u32 get_string_width(struct DrawCtx const* dc, char const* str, u32 len);
-static void draw_selection_circle(struct DrawCtx* dc, struct SelectionCircle const* sc, i32 pointer_x, i32 pointer_y);
+static u32 get_int_width(struct DrawCtx* dc, char const* format, u32 i);
+static u32 get_string_width(struct DrawCtx* dc, char const* str, u32 len);
+static void sel_circ_paint(struct DrawCtx* dc, struct SelectionCircle const* sc, Drawable d, Bool focused);
+static void draw_selection_circle(struct DrawCtx* dc, struct SelectionCircle* sc, i32 pointer_x, i32 pointer_y);
+static XImage* shm_image_new(struct DrawCtx const* dc, XShmSegmentInfo* seg, u32 w, u32 h);
+static void shm_image_free(Display* dp, XImage* im, XShmSegmentInfo* seg);
+static Rect canvas_visible_rect(struct DrawCtx const* dc);
+static void cache_upload(struct DrawCtx* dc, struct Raster* rs, Pixmap pm, Rect vis);
+static void cache_level_fit(struct DrawCtx* dc, struct CacheLevel* cl, struct Raster* rs, Bool pad);
+static Bool cache_level_zoom(struct DrawCtx* dc, struct CacheLevel* cl, double z);
 static void update_screen(struct Ctx* ctx);
+static char* statusline_state_dyn(struct Ctx const* ctx);
+static void statusline_render(struct Ctx* ctx);
 static void update_statusline(struct Ctx* ctx);
 static void show_message(struct Ctx* ctx, char const* msg);
 static void show_message_va(struct Ctx* ctx, char const* fmt, ...);
+static u64 time_us(void);
+static void schedule_redraw(struct Ctx* ctx);
+static void redraw_now(struct Ctx* ctx);
 
 static struct Ctx ctx_init(Display* dp);
 static void setup(Display* dp, struct Ctx* ctx);
@@ -478,10 +802,19 @@ static Bool configure_notify_hdlr(struct Ctx* ctx, XEvent* event);
 static Bool selection_request_hdlr(struct Ctx* ctx, XEvent* event);
 static Bool selection_notify_hdlr(struct Ctx* ctx, XEvent* event);
 static Bool client_message_hdlr(struct Ctx* ctx, XEvent* event);
+static Bool shm_completion_hdlr(struct Ctx* ctx, XEvent* event);
 static void cleanup(struct Ctx* ctx);
 // clang-format on
 
 static Bool is_verbose_output = False;
+static u32 last_tile_gen = 0;
+static u32 tile_unshares = 0;  // times shared tile lost one of its owners
+// blending kernels, widest supported by cpu is chosen in blend_init
+static struct {
+    void (*row)(argb* dst, u8 const* alpha, u32 len, argb col);
+    void (*flatten)(argb* px, u32 len, argb bg);
+} blend_impl = {&blend_row_scalar, &blend_flatten_scalar};
+static Bool shm_attach_failed = False;
 static Atom atoms[A_Last];
 static XImage* images[I_Last];
 
@@ -512,14 +845,14 @@ i32 main(i32 argc, char** argv) {
             file_ctx_set(&ctx.fout, argv[++i]);
         } else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--width")) {
             main_arg_bound_check("-w or --width", argc, argv, i);
-            // ctx.dc.width == ctx.dc.cv.im->width at program start
+            // ctx.dc.width == ctx.dc.cv.rs.w at program start
             ctx.dc.width = strtol(argv[++i], NULL, 0);
             if (!ctx.dc.width) {
                 die("xpaint: canvas width must be positive number");
             }
         } else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--height")) {
             main_arg_bound_check("-h or --height", argc, argv, i);
-            // ctx.dc.height == ctx.dc.cv.im->height at program start
+            // ctx.dc.height == ctx.dc.cv.rs.h at program start
             ctx.dc.height = strtol(argv[++i], NULL, 0);
             if (!ctx.dc.height) {
                 die("xpaint: canvas height must be positive number");
@@ -694,12 +1027,14 @@ void tc_set_tool(struct ToolCtx* tc, enum ToolTag type) {
             new_tc.on_release = &tool_drawer_on_release;
             new_tc.on_drag = &tool_drawer_on_drag;
             new_tc.d.drawer.fn = &canvas_draw_fn_brush;
+            new_tc.d.drawer.stroke = &canvas_stroke_fn_brush;
             break;
         case Tool_Pencil:
             new_tc.on_press = &tool_drawer_on_press;
             new_tc.on_release = &tool_drawer_on_release;
             new_tc.on_drag = &tool_drawer_on_drag;
             new_tc.d.drawer.fn = &canvas_draw_fn_pencil;
+            new_tc.d.drawer.stroke = &canvas_stroke_fn_pencil;
             break;
         case Tool_Fill: new_tc.on_release = &tool_fill_on_release; break;
         case Tool_Picker: new_tc.on_release = &tool_picker_on_release; break;
@@ -743,6 +1078,8 @@ Bool fnt_set(struct DrawCtx* dc, char const* font_name) {
     fnt_free(dc->dp, &dc->fnt);
     dc->fnt.xfont = xfont;
     dc->fnt.h = xfont->ascent + xfont->descent;
+    sh_new_strdup(dc->fnt.widths_hm);
+    str_free(&dc->sl.state_dyn);  // rerender with new font
     return True;
 }
 
@@ -751,6 +1088,7 @@ void fnt_free(Display* dp, struct Fnt* fnt) {
         XftFontClose(dp, fnt->xfont);
         fnt->xfont = NULL;
     }
+    shfree(fnt->widths_hm);
 }
 
 void file_ctx_set(struct FileCtx* file_ctx, char const* file_path) {
@@ -821,6 +1159,23 @@ enum ImageType file_type(char const* file_path) {
     return result;
 }
 
+// layout of images xpaint creates, pixels can be accessed without Xlib
+Bool ximage_is_argb32(XImage const* im) {
+    static u16 const probe = 1;
+    i32 const native_order = *(u8 const*)&probe ? LSBFirst : MSBFirst;
+    Bool const masks_ok = (im->red_mask == 0 && im->green_mask == 0
+                           && im->blue_mask == 0)
+        || (im->red_mask == 0xFF0000 && im->green_mask == 0xFF00
+            && im->blue_mask == 0xFF);
+    return im->format == ZPixmap && im->bits_per_pixel == 32
+        && im->byte_order == native_order && im->data != NULL && masks_ok;
+}
+
+// valid only if ximage_is_argb32
+argb* ximage_row(XImage const* im, i32 y) {
+    return (argb*)(im->data + (usize)y * im->bytes_per_line);
+}
+
 u8* ximage_to_rgb(XImage const* image, Bool rgba) {
     u32 w = image->width;
     u32 h = image->height;
@@ -830,10 +1185,12 @@ u8* ximage_to_rgb(XImage const* image, Bool rgba) {
     if (data == NULL) {
         return NULL;
     }
+    Bool const direct = ximage_is_argb32(image);
     i32 ii = 0;
     for (i32 y = 0; y < h; ++y) {
+        argb const* row = direct ? ximage_row(image, y) : NULL;
         for (i32 x = 0; x < w; ++x) {
-            u64 pixel = XGetPixel((XImage*)image, x, y);
+            u64 pixel = row ? row[x] : XGetPixel((XImage*)image, x, y);
             data[ii + 0] = (pixel & 0xFF0000) >> 16U;
             data[ii + 1] = (pixel & 0xFF00) >> 8U;
             data[ii + 2] = (pixel & 0xFF);
@@ -846,6 +1203,44 @@ u8* ximage_to_rgb(XImage const* image, Bool rgba) {
     return data;
 }
 
+void pixels_fill(argb* dst, u32 len, argb col) {
+    u32 i = 0;
+#ifdef __SSE2__
+    __m128i const v = _mm_set1_epi32((i32)col);
+    for (; i + 8 <= len; i += 8) {
+        _mm_storeu_si128((__m128i*)&dst[i], v);
+        _mm_storeu_si128((__m128i*)&dst[i + 4], v);
+    }
+#endif
+    for (; i < len; ++i) {
+        dst[i] = col;
+    }
+}
+
+// canvas pixels to bytes in R, G, B, A order
+void pixels_to_rgba(u8* dst, argb const* src, u32 len) {
+    u32 i = 0;
+#ifdef __SSE2__
+    // swap red and blue in each 32-bit lane, little endian
+    __m128i const ag = _mm_set1_epi32((i32)0xFF00FF00);
+    __m128i const lo = _mm_set1_epi32(0xFF);
+    for (; i + 4 <= len; i += 4) {
+        __m128i const p = _mm_loadu_si128((__m128i const*)&src[i]);
+        __m128i const r = _mm_and_si128(_mm_srli_epi32(p, 16), lo);
+        __m128i const b = _mm_slli_epi32(_mm_and_si128(p, lo), 16);
+        __m128i const v =
+            _mm_or_si128(_mm_and_si128(p, ag), _mm_or_si128(r, b));
+        _mm_storeu_si128((__m128i*)&dst[i * 4], v);
+    }
+#endif
+    for (; i < len; ++i) {
+        dst[i * 4 + 0] = (src[i] >> 16) & 0xFF;
+        dst[i * 4 + 1] = (src[i] >> 8) & 0xFF;
+        dst[i * 4 + 2] = src[i] & 0xFF;
+        dst[i * 4 + 3] = src[i] >> 24;
+    }
+}
+
 argb blend_background(argb fg, argb bg, u32 a) {
     u32 const fgr = (fg >> 16) & 0xFF;
     u32 const fgg = (fg >> 8) & 0xFF;
@@ -862,8 +1257,162 @@ argb blend_background(argb fg, argb bg, u32 a) {
     u32 const green = (alpha * fgg + inv_alpha * bgg) >> 8;
     u32 const blue = (alpha * fgb + inv_alpha * bgb) >> 8;
 
-    return 0xFF << 24 | red << 16 | green << 8 | blue;
+    return 0xFF000000 | red << 16 | green << 8 | blue;
+}
+
+void blend_init(void) {
+#ifdef __SSE2__
+    blend_impl.row = &blend_row_sse2;
+    blend_impl.flatten = &blend_flatten_sse2;
+#endif
+#ifdef BLEND_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        blend_impl.row = &blend_row_avx2;
+        blend_impl.flatten = &blend_flatten_avx2;
+    }
+#endif
+    trace("xpaint: blend kernels initialized");
+}
+
+// blends col over each pixel with its alpha, see blend_background
+void blend_row(argb* dst, u8 const* alpha, u32 len, argb col) {
+    blend_impl.row(dst, alpha, len, col);
+}
+
+void blend_row_scalar(argb* dst, u8 const* alpha, u32 len, argb col) {
+    for (u32 i = 0; i < len; ++i) {
+        dst[i] = blend_background(col, dst[i], alpha[i]);
+    }
+}
+
+// blends each pixel over bg by its own alpha channel
+void blend_flatten(argb* px, u32 len, argb bg) {
+    blend_impl.flatten(px, len, bg);
+}
+
+void blend_flatten_scalar(argb* px, u32 len, argb bg) {
+    for (u32 i = 0; i < len; ++i) {
+        px[i] = blend_background(px[i], bg, (px[i] >> 24) & 0xFF);
+    }
+}
+
+#ifdef __SSE2__
+// blend_background on 4 pixels, a holds alpha in every byte of pixel
+static __m128i blend_px4(__m128i fg, __m128i bg, __m128i a) {
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const one = _mm_set1_epi16(1);
+    __m128i const full = _mm_set1_epi16(256);
+    __m128i result[2];
+    for (i32 half = 0; half < 2; ++half) {
+        __m128i const f = half ? _mm_unpackhi_epi8(fg, zero)
+                               : _mm_unpacklo_epi8(fg, zero);
+        __m128i const b = half ? _mm_unpackhi_epi8(bg, zero)
+                               : _mm_unpacklo_epi8(bg, zero);
+        __m128i const a16 =
+            half ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+        // at most 257 * 0xFF, so sum fits 16 bits
+        __m128i const sum = _mm_add_epi16(
+            _mm_mullo_epi16(f, _mm_add_epi16(a16, one)),
+            _mm_mullo_epi16(b, _mm_sub_epi16(full, a16))
+        );
+        result[half] = _mm_srli_epi16(sum, 8);
+    }
+    return _mm_or_si128(
+        _mm_packus_epi16(result[0], result[1]),
+        _mm_set1_epi32((i32)0xFF000000)
+    );
+}
+
+void blend_row_sse2(argb* dst, u8 const* alpha, u32 len, argb col) {
+    __m128i const fg = _mm_set1_epi32((i32)col);
+    u32 i = 0;
+    for (; i + 4 <= len; i += 4) {
+        i32 a4 = 0;
+        memcpy(&a4, &alpha[i], sizeof(a4));
+        __m128i a = _mm_cvtsi32_si128(a4);
+        a = _mm_unpacklo_epi8(a, a);
+        a = _mm_unpacklo_epi16(a, a);
+        __m128i const bg = _mm_loadu_si128((__m128i const*)&dst[i]);
+        _mm_storeu_si128((__m128i*)&dst[i], blend_px4(fg, bg, a));
+    }
+    blend_row_scalar(&dst[i], &alpha[i], len - i, col);
+}
+
+void blend_flatten_sse2(argb* px, u32 len, argb bg) {
+    __m128i const b = _mm_set1_epi32((i32)bg);
+    u32 i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m128i const fg = _mm_loadu_si128((__m128i const*)&px[i]);
+        __m128i a = _mm_srli_epi32(fg, 24);
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+        _mm_storeu_si128((__m128i*)&px[i], blend_px4(fg, b, a));
+    }
+    blend_flatten_scalar(&px[i], len - i, bg);
+}
+#endif
+
+#ifdef BLEND_AVX2
+// same as blend_px4 for 8 pixels
+__attribute__((target("avx2"))) static __m256i
+blend_px8(__m256i fg, __m256i bg, __m256i a) {
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const one = _mm256_set1_epi16(1);
+    __m256i const full = _mm256_set1_epi16(256);
+    __m256i result[2];
+    for (i32 half = 0; half < 2; ++half) {
+        __m256i const f = half ? _mm256_unpackhi_epi8(fg, zero)
+                               : _mm256_unpacklo_epi8(fg, zero);
+        __m256i const b = half ? _mm256_unpackhi_epi8(bg, zero)
+                               : _mm256_unpacklo_epi8(bg, zero);
+        __m256i const a16 = half ? _mm256_unpackhi_epi8(a, zero)
+                                 : _mm256_unpacklo_epi8(a, zero);
+        __m256i const sum = _mm256_add_epi16(
+            _mm256_mullo_epi16(f, _mm256_add_epi16(a16, one)),
+            _mm256_mullo_epi16(b, _mm256_sub_epi16(full, a16))
+        );
+        result[half] = _mm256_srli_epi16(sum, 8);
+    }
+    // unpack and pack work within 128-bit lanes, so pixel order is kept
+    return _mm256_or_si256(
+        _mm256_packus_epi16(result[0], result[1]),
+        _mm256_set1_epi32((i32)0xFF000000)
+    );
+}
+
+__attribute__((target("avx2"))) void
+blend_row_avx2(argb* dst, u8 const* alpha, u32 len, argb col) {
+    __m256i const fg = _mm256_set1_epi32((i32)col);
+    __m256i const spread = _mm256_set1_epi32(0x01010101);
+    u32 i = 0;
+    for (; i + 8 <= len; i += 8) {
+        i64 a8 = 0;
+        memcpy(&a8, &alpha[i], sizeof(a8));
+        __m256i const a = _mm256_mullo_epi32(
+            _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(a8)),
+            spread
+        );
+        __m256i const bg = _mm256_loadu_si256((__m256i const*)&dst[i]);
+        _mm256_storeu_si256((__m256i*)&dst[i], blend_px8(fg, bg, a));
+    }
+    blend_row_sse2(&dst[i], &alpha[i], len - i, col);
+}
+
+__attribute__((target("avx2"))) void
+blend_flatten_avx2(argb* px, u32 len, argb bg) {
+    __m256i const b = _mm256_set1_epi32((i32)bg);
+    __m256i const spread = _mm256_set1_epi32(0x01010101);
+    u32 i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i const fg = _mm256_loadu_si256((__m256i const*)&px[i]);
+        __m256i const a =
+            _mm256_mullo_epi32(_mm256_srli_epi32(fg, 24), spread);
+        _mm256_storeu_si256((__m256i*)&px[i], blend_px8(fg, b, a));
+    }
+    blend_flatten_sse2(&px[i], len - i, bg);
 }
+#endif
 
 static u32 argb_to_abgr(argb v) {
     u32 const a = v & 0xFF000000;
@@ -889,10 +1438,10 @@ static XImage* read_file_from_memory(
     }
     // process image data
     argb* image = (argb*)image_data;
+    if (bg) {
+        blend_flatten(image, width * height, bg);
+    }
     for (i32 i = 0; i < (width * height); ++i) {
-        if (bg) {
-            image[i] = blend_background(image[i], bg, (image[i] >> 24) & 0xFF);
-        }
         // https://stackoverflow.com/a/17030897
         image[i] = argb_to_abgr(image[i]);
     }
@@ -929,23 +1478,144 @@ Bool save_file(struct DrawCtx* dc, enum ImageType type, char const* file_path) {
     if (type == IMT_Unknown) {
         return False;
     }
+    FILE* file = fopen(file_path, "wb");
+    if (!file) {
+        return False;
+    }
     Bool result = False;
 
-    i32 w = dc->cv.im->width;
-    i32 h = dc->cv.im->height;
-    u8* rgba_dyn = ximage_to_rgb(dc->cv.im, True);
     switch (type) {
         case IMT_Png: {
-            stbi_write_png_compression_level = dc->png_compression_level;
-            result = stbi_write_png(file_path, w, h, 4, rgba_dyn, 0);
+            result = save_png(&dc->cv.rs, file, dc->png_compression_level);
         } break;
         case IMT_Jpg: {
-            i32 quality = dc->jpg_quality_level;
-            result = stbi_write_jpg(file_path, w, h, 4, rgba_dyn, quality);
+            result = save_jpg(&dc->cv.rs, file, dc->jpg_quality_level);
         } break;
         case IMT_Unknown: UNREACHABLE();
     }
+    if (fclose(file)) {
+        result = False;
+    }
+    return result;
+}
+
+// rows are converted in batches, no copy of whole image is made
+Bool save_png(struct Raster const* rs, FILE* file, i32 level) {
+    u32 const batch = MAX(EXPORT_BATCH_ROWS, 1);
+    argb* row_dyn = ecalloc(rs->w, sizeof(argb));
+    u8* rgba_dyn = ecalloc((usize)rs->w * batch, 4);
+    png_bytep* rows_dyn = ecalloc(batch, sizeof(png_bytep));
+    for (u32 i = 0; i < batch; ++i) {
+        rows_dyn[i] = &rgba_dyn[(usize)i * rs->w * 4];
+    }
+
+    Bool result = False;
+    png_structp png =
+        png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!info) {
+        goto cleanup;
+    }
+    // libpng jumps here on error
+    if (setjmp(png_jmpbuf(png))) {
+        goto cleanup;
+    }
+    png_init_io(png, file);
+    png_set_compression_level(png, CLAMP(level, 0, 9));
+    png_set_IHDR(
+        png,
+        info,
+        rs->w,
+        rs->h,
+        8,
+        PNG_COLOR_TYPE_RGBA,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+    );
+    png_write_info(png, info);
+    for (u32 y = 0; y < rs->h; y += batch) {
+        u32 const n = MIN(batch, rs->h - y);
+        for (u32 i = 0; i < n; ++i) {
+            raster_read_row(rs, 0, (i32)(y + i), rs->w, row_dyn);
+            pixels_to_rgba(rows_dyn[i], row_dyn, rs->w);
+        }
+        png_write_rows(png, rows_dyn, n);
+    }
+    png_write_end(png, NULL);
+    result = True;
+
+cleanup:
+    png_destroy_write_struct(&png, &info);
+    free(rows_dyn);
+    free(rgba_dyn);
+    free(row_dyn);
+    return result;
+}
+
+struct JpgError {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+};
+
+static void jpg_error_exit(j_common_ptr cinfo) {
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(((struct JpgError*)cinfo->err)->jmp, 1);
+}
+
+// alpha channel is dropped
+Bool save_jpg(struct Raster const* rs, FILE* file, i32 quality) {
+    u32 const batch = MAX(EXPORT_BATCH_ROWS, 1);
+    argb* row_dyn = ecalloc(rs->w, sizeof(argb));
+    u8* rgba_dyn = ecalloc((usize)rs->w * batch, 4);
+    JSAMPROW* rows_dyn = ecalloc(batch, sizeof(JSAMPROW));
+    for (u32 i = 0; i < batch; ++i) {
+        rows_dyn[i] = &rgba_dyn[(usize)i * rs->w * 4];
+    }
+
+    Bool result = False;
+    struct jpeg_compress_struct cinfo;
+    struct JpgError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = &jpg_error_exit;
+    if (setjmp(err.jmp)) {
+        goto cleanup;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, file);
+    cinfo.image_width = rs->w;
+    cinfo.image_height = rs->h;
+#ifdef JCS_EXTENSIONS
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_RGBX;
+#else
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+#endif
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, CLAMP(quality, 1, 100), TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    for (u32 y = 0; y < rs->h; y += batch) {
+        u32 const n = MIN(batch, rs->h - y);
+        for (u32 i = 0; i < n; ++i) {
+            raster_read_row(rs, 0, (i32)(y + i), rs->w, row_dyn);
+            pixels_to_rgba(rows_dyn[i], row_dyn, rs->w);
+#ifndef JCS_EXTENSIONS
+            for (u32 x = 0; x < rs->w; ++x) {
+                memmove(&rows_dyn[i][x * 3], &rows_dyn[i][x * 4], 3);
+            }
+#endif
+        }
+        jpeg_write_scanlines(&cinfo, rows_dyn, n);
+    }
+    jpeg_finish_compress(&cinfo);
+    result = True;
+
+cleanup:
+    jpeg_destroy_compress(&cinfo);
+    free(rows_dyn);
     free(rgba_dyn);
+    free(row_dyn);
     return result;
 }
 
@@ -985,6 +1655,54 @@ ClCPrcResult cl_cmd_process(struct Ctx* ctx, struct ClCommand const* cl_cmd) {
                 case ClCDS_JpgQuality: {
                     ctx->dc.jpg_quality_level = cl_cmd->d.set.d.jpg_qlt.quality;
                 } break;
+                case ClCDS_FillTol: {
+                    CURR_TC(ctx).sdata.fill_tol =
+                        cl_cmd->d.set.d.fill_tol.value;
+                } break;
+                case ClCDS_HistBudget: {
+                    ctx->hist_budget_mb = cl_cmd->d.set.d.hist_budget.mb;
+                    history_evict(ctx);
+                    msg_to_show = str_new(
+                        "history uses %.1f of %u MiB, %.1f MiB spilled "
+                        "(%td undo, %td redo)",
+                        (double)history_usage(ctx) / (1 << 20),
+                        ctx->hist_budget_mb,
+                        (double)spill_usage(&ctx->spill) / (1 << 20),
+                        arrlen(ctx->hist_prevarr),
+                        arrlen(ctx->hist_nextarr)
+                    );
+                } break;
+                case ClCDS_HistResident: {
+                    ctx->hist_resident = cl_cmd->d.set.d.hist_resident.value;
+                    msg_to_show = str_new(
+                        "history keeps %u entries in memory, %.1f MiB spilled",
+                        ctx->hist_resident,
+                        (double)spill_usage(&ctx->spill) / (1 << 20)
+                    );
+                } break;
+                case ClCDS_HistOps: {
+                    u32 const interval = cl_cmd->d.set.d.hist_ops.interval;
+                    if (interval == ctx->oplog.interval) {
+                        msg_to_show = interval
+                            ? str_new(
+                                  "operation log on, checkpoint every %u "
+                                  "actions",
+                                  interval
+                              )
+                            : str_new("operation log off");
+                        break;
+                    }
+                    // recorded history can't be converted
+                    history_commit(ctx);
+                    historyarr_clear(&ctx->spill, &ctx->hist_nextarr);
+                    historyarr_clear(&ctx->spill, &ctx->hist_prevarr);
+                    oplog_clear(&ctx->oplog);
+                    ctx->oplog.interval = interval;
+                    msg_to_show = str_new(
+                        "history cleared, operation log %s",
+                        ctx->oplog.interval ? "on" : "off"
+                    );
+                } break;
                 case ClCDS_Last: assert(!"invalid tag");
             }
         } break;
@@ -1110,6 +1828,50 @@ static ClCPrsResult cl_cmd_parse_helper(struct Ctx* ctx, char* cl) {
                .d.ok.d.set.d.jpg_qlt.quality =
                    (i32)strtol(strtok(NULL, ""), NULL, 0)};
         }
+        if (!strcmp(prop, cl_set_prop_from_enum(ClCDS_FillTol))) {
+            // without value resets to default, like line_w
+            char const* arg = strtok(NULL, " ");
+            return (ClCPrsResult
+            ) {.t = ClCPrs_Ok,
+               .d.ok.t = ClC_Set,
+               .d.ok.d.set.t = ClCDS_FillTol,
+               .d.ok.d.set.d.fill_tol.value =
+                   arg ? CLAMP(strtol(arg, NULL, 0), 0, 0xFF)
+                       : TOOLS.default_fill_tol};
+        }
+        if (!strcmp(prop, cl_set_prop_from_enum(ClCDS_HistBudget))) {
+            // without value only reports usage
+            char const* arg = strtok(NULL, " ");
+            return (ClCPrsResult
+            ) {.t = ClCPrs_Ok,
+               .d.ok.t = ClC_Set,
+               .d.ok.d.set.t = ClCDS_HistBudget,
+               .d.ok.d.set.d.hist_budget.mb =
+                   arg ? CLAMP(strtol(arg, NULL, 0), 0, 1 << 20)
+                       : ctx->hist_budget_mb};
+        }
+        if (!strcmp(prop, cl_set_prop_from_enum(ClCDS_HistResident))) {
+            // without value only reports current one
+            char const* arg = strtok(NULL, " ");
+            return (ClCPrsResult
+            ) {.t = ClCPrs_Ok,
+               .d.ok.t = ClC_Set,
+               .d.ok.d.set.t = ClCDS_HistResident,
+               .d.ok.d.set.d.hist_resident.value =
+                   arg ? CLAMP(strtol(arg, NULL, 0), 1, 1 << 20)
+                       : ctx->hist_resident};
+        }
+        if (!strcmp(prop, cl_set_prop_from_enum(ClCDS_HistOps))) {
+            // without value only reports current one
+            char const* arg = strtok(NULL, " ");
+            return (ClCPrsResult
+            ) {.t = ClCPrs_Ok,
+               .d.ok.t = ClC_Set,
+               .d.ok.d.set.t = ClCDS_HistOps,
+               .d.ok.d.set.d.hist_ops.interval =
+                   arg ? CLAMP(strtol(arg, NULL, 0), 0, 1 << 20)
+                       : ctx->oplog.interval};
+        }
         return (ClCPrsResult
         ) {.t = ClCPrs_EInvSubArg,
            .d.invsubarg.arg_dyn = str_new("%s", cl_cmd_from_enum(ClC_Set)),
@@ -1183,6 +1945,10 @@ void cl_cmd_parse_res_free(ClCPrsResult* res) {
                         case ClCDS_Col:
                         case ClCDS_PngCompression:
                         case ClCDS_JpgQuality:
+                        case ClCDS_FillTol:
+                        case ClCDS_HistBudget:
+                        case ClCDS_HistResident:
+                        case ClCDS_HistOps:
                         case ClCDS_Last:
                             break;  // no default branch to enable warnings
                     }
@@ -1237,6 +2003,10 @@ static char const* cl_set_prop_from_enum(enum ClCDSTag t) {
         case ClCDS_LineW: return "line_w";
         case ClCDS_PngCompression: return "png_cmpr";
         case ClCDS_JpgQuality: return "jpg_qlty";
+        case ClCDS_FillTol: return "fill_tol";
+        case ClCDS_HistBudget: return "history_budget";
+        case ClCDS_HistResident: return "history_resident";
+        case ClCDS_HistOps: return "history_ops";
         case ClCDS_Last: return "last";
     }
     UNREACHABLE();
@@ -1390,6 +2160,7 @@ static void sel_circ_figure_set_triangle(struct Ctx* ctx) { sel_circ_set_figure(
 // clang-format on
 
 void sel_circ_init(struct Ctx* ctx, i32 x, i32 y) {
+    sel_circ_free(ctx->dc.dp, &ctx->sc);  // if not released
     if (CURR_TC(ctx).t == Tool_Figure) {
         static struct Item callbacks[] = {
             {.on_select = &sel_circ_figure_set_circle, .icon = I_Figure},
@@ -1415,9 +2186,81 @@ void sel_circ_init(struct Ctx* ctx, i32 x, i32 y) {
     ctx->sc.x = x;
     ctx->sc.y = y;
     ctx->sc.is_active = True;
+    ctx->sc.is_shown = False;
+
+    struct DrawCtx* dc = &ctx->dc;
+    struct SelectionCircle* sc = &ctx->sc;
+    sc->r = SELECTION_CIRCLE.outer_r_px + SELECTION_CIRCLE.line_w;
+    u32 const side = sc->r * 2;
+    /* images */ {
+        sc->base_pm =
+            XCreatePixmap(dc->dp, dc->window, side, side, dc->vinfo.depth);
+        sc->focus_pm =
+            XCreatePixmap(dc->dp, dc->window, side, side, dc->vinfo.depth);
+        sel_circ_paint(dc, sc, sc->base_pm, False);
+        sel_circ_paint(dc, sc, sc->focus_pm, True);
+    }
+    /* masks */ {
+        i32 const outer_r = (i32)SELECTION_CIRCLE.outer_r_px;
+        i32 const c = (i32)sc->r;
+        double const segment_deg = 360.0 / MAX(1, sc->item_count);
+
+        sc->mask = XCreatePixmap(dc->dp, dc->window, side, side, 1);
+        GC gc = XCreateGC(dc->dp, sc->mask, 0, NULL);
+        XSetForeground(dc->dp, gc, 0);
+        XFillRectangle(dc->dp, sc->mask, gc, 0, 0, side, side);
+        XSetForeground(dc->dp, gc, 1);
+        XSetLineAttributes(
+            dc->dp,
+            gc,
+            SELECTION_CIRCLE.line_w,
+            SELECTION_CIRCLE.line_style,
+            SELECTION_CIRCLE.cap_style,
+            SELECTION_CIRCLE.join_style
+        );
+        // clang-format off
+        XFillArc(
+            dc->dp, sc->mask, gc,
+            c - outer_r, c - outer_r, outer_r * 2, outer_r * 2,
+            0, 360 * 64
+        );
+        XDrawArc(
+            dc->dp, sc->mask, gc,
+            c - outer_r, c - outer_r, outer_r * 2, outer_r * 2,
+            0, 360 * 64
+        );
+        // clang-format on
+
+        sc->item_masks_dyn = ecalloc(sc->item_count, sizeof(Pixmap));
+        for (u32 item = 0; item < sc->item_count; ++item) {
+            Pixmap m = XCreatePixmap(dc->dp, dc->window, side, side, 1);
+            XSetForeground(dc->dp, gc, 0);
+            XFillRectangle(dc->dp, m, gc, 0, 0, side, side);
+            XSetForeground(dc->dp, gc, 1);
+            // clang-format off
+            XFillArc(
+                dc->dp, m, gc,
+                c - outer_r, c - outer_r, outer_r * 2, outer_r * 2,
+                (i32)(item * segment_deg) * 64, (i32)segment_deg * 64
+            );
+            // clang-format on
+            sc->item_masks_dyn[item] = m;
+        }
+        XFreeGC(dc->dp, gc);
+    }
 }
 
-void sel_circ_free(struct SelectionCircle* sel_circ) {
+void sel_circ_free(Display* dp, struct SelectionCircle* sel_circ) {
+    if (sel_circ->is_active) {
+        XFreePixmap(dp, sel_circ->base_pm);
+        XFreePixmap(dp, sel_circ->focus_pm);
+        XFreePixmap(dp, sel_circ->mask);
+        for (u32 item = 0; item < sel_circ->item_count; ++item) {
+            XFreePixmap(dp, sel_circ->item_masks_dyn[item]);
+        }
+        free(sel_circ->item_masks_dyn);
+        sel_circ->item_masks_dyn = NULL;
+    }
     sel_circ->is_active = False;
 }
 
@@ -1461,8 +2304,8 @@ void tool_selection_on_press(
             sd->drag_from = pointer;
             sd->drag_to = pointer;
         } else {
-            sd->begin.x = CLAMP(pointer.x, 0, dc->cv.im->width);
-            sd->begin.y = CLAMP(pointer.y, 0, dc->cv.im->height);
+            sd->begin.x = CLAMP(pointer.x, 0, (i32)dc->cv.rs.w);
+            sd->begin.y = CLAMP(pointer.y, 0, (i32)dc->cv.rs.h);
             sd->end = PNIL;
         }
     }
@@ -1488,14 +2331,20 @@ void tool_selection_on_release(
             pointer.y - sd->drag_from.y
         };
         Pair area = {MIN(sd->begin.x, sd->end.x), MIN(sd->begin.y, sd->end.y)};
-        canvas_copy_region(
+        op_do(
             ctx,
-            area,
-            (Pair
-            ) {MAX(sd->begin.x, sd->end.x) - area.x,
-               MAX(sd->begin.y, sd->end.y) - area.y},
-            (Pair) {area.x + move_vec.x, area.y + move_vec.y},
-            !(event->state & ShiftMask)
+            &(struct Op) {
+                .t = Op_Copy,
+                .d.copy = {
+                    .from = area,
+                    .dims = {
+                        MAX(sd->begin.x, sd->end.x) - area.x,
+                        MAX(sd->begin.y, sd->end.y) - area.y,
+                    },
+                    .to = {area.x + move_vec.x, area.y + move_vec.y},
+                    .clear_source = !(event->state & ShiftMask),
+                },
+            }
         );
     } else if (ctx->input.is_dragging) {
         // select area
@@ -1521,8 +2370,8 @@ void tool_selection_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
     if (SELECTION_DRAGGING(tc)) {
         tc->d.sel.drag_to = pointer;
     } else if (ctx->input.is_holding) {
-        tc->d.sel.end.x = CLAMP(pointer.x, 0, dc->cv.im->width);
-        tc->d.sel.end.y = CLAMP(pointer.y, 0, dc->cv.im->height);
+        tc->d.sel.end.x = CLAMP(pointer.x, 0, (i32)dc->cv.rs.w);
+        tc->d.sel.end.y = CLAMP(pointer.y, 0, (i32)dc->cv.rs.h);
     }
 }
 
@@ -1531,6 +2380,7 @@ void tool_drawer_on_press(struct Ctx* ctx, XButtonPressedEvent const* event) {
         return;
     }
 
+    stroke_end(&ctx->stroke);
     if (!(event->state & ShiftMask)) {
         CURR_TC(ctx).sdata.anchor =
             point_from_scr_to_cv_xy(&ctx->dc, event->x, event->y);
@@ -1543,17 +2393,20 @@ void tool_drawer_on_release(
 ) {
     struct ToolCtx* tc = &CURR_TC(ctx);
     struct DrawCtx* dc = &ctx->dc;
-    if (event->button != XLeftMouseBtn || ctx->input.is_dragging) {
+    if (event->button != XLeftMouseBtn) {
         return;
     }
 
-    Pair pointer = point_from_scr_to_cv_xy(dc, event->x, event->y);
-    if (event->state & ShiftMask) {
-        canvas_line(ctx, tc->sdata.anchor, pointer, tc->d.drawer.fn);
-    } else {
-        tc->d.drawer.fn(ctx, pointer);
+    if (!ctx->input.is_dragging) {
+        Pair pointer = point_from_scr_to_cv_xy(dc, event->x, event->y);
+        if (event->state & ShiftMask) {
+            tc->d.drawer.stroke(ctx, tc->sdata.anchor, pointer);
+        } else {
+            tc->d.drawer.fn(ctx, pointer);
+        }
+        tc->sdata.anchor = pointer;
     }
-    tc->sdata.anchor = point_from_scr_to_cv_xy(dc, event->x, event->y);
+    stroke_end(&ctx->stroke);
 }
 
 void tool_drawer_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
@@ -1564,8 +2417,8 @@ void tool_drawer_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
     }
 
     Pair pointer = point_from_scr_to_cv_xy(dc, event->x, event->y);
-    canvas_line(ctx, tc->sdata.anchor, pointer, tc->d.drawer.fn);
-    tc->sdata.anchor = point_from_scr_to_cv_xy(dc, event->x, event->y);
+    tc->d.drawer.stroke(ctx, tc->sdata.anchor, pointer);
+    tc->sdata.anchor = pointer;
 }
 
 void tool_figure_on_release(
@@ -1574,12 +2427,21 @@ void tool_figure_on_release(
 ) {
     struct ToolCtx* tc = &CURR_TC(ctx);
     struct DrawCtx* dc = &ctx->dc;
-    if (event->button != XLeftMouseBtn || ctx->input.is_dragging) {
+    if (event->button != XLeftMouseBtn) {
         return;
     }
 
+    assert(tc->t == Tool_Figure);
     Pair pointer = point_from_scr_to_cv_xy(dc, event->x, event->y);
-    canvas_figure(ctx, pointer, tc->sdata.anchor);
+    op_do(
+        ctx,
+        &(struct Op) {
+            .t = Op_Figure,
+            .col = *tc_curr_col(tc),
+            .line_w = tc->sdata.line_w,
+            .d.figure = {tc->d.fig, pointer, tc->sdata.anchor},
+        }
+    );
 }
 
 void tool_figure_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
@@ -1589,48 +2451,195 @@ void tool_figure_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
         return;
     }
 
-    history_restore(ctx);
+    // canvas is changed only on release
+    assert(tc->t == Tool_Figure);
+    overlay_clear(&dc->cv);
     Pair pointer = point_from_scr_to_cv_xy(dc, event->x, event->y);
-    canvas_figure(ctx, pointer, tc->sdata.anchor);
+    canvas_figure(
+        &dc->cv.overlay,
+        &tc->d.fig,
+        *tc_curr_col(tc),
+        tc->sdata.line_w,
+        pointer,
+        tc->sdata.anchor
+    );
 }
 
-static void flood_fill(XImage* im, argb targ_col, i32 x, i32 y) {
-    assert(im);
-    if (x < 0 || y < 0 || x >= im->width || y >= im->height) {
-        return;
+static Bool argb_similar(argb a, argb b, u32 tol) {
+    for (u32 ch = 0; ch < 32; ch += 8) {
+        if (abs((i32)((a >> ch) & 0xFF) - (i32)((b >> ch) & 0xFF)) > tol) {
+            return False;
+        }
+    }
+    return True;
+}
+
+struct Flood {
+    struct Raster const* rs;
+    argb area_col;
+    u32 tol;
+    // bit per pixel, rows start at word boundary. NULL if filled pixels
+    // can't match area color
+    u64* filled_dyn;
+    usize row_words;
+};
+
+static Bool flood_col(struct Flood const* f, argb px) {
+    return f->tol ? argb_similar(px, f->area_col, f->tol) : px == f->area_col;
+}
+
+#ifdef __SSE2__
+// flood_col of 4 pixels as bit mask
+static u32 flood_col4(struct Flood const* f, argb const* px) {
+    __m128i const p = _mm_loadu_si128((__m128i const*)px);
+    __m128i const a = _mm_set1_epi32((i32)f->area_col);
+    __m128i eq;
+    if (f->tol) {
+        // per channel |p - a| <= tol
+        __m128i const d =
+            _mm_or_si128(_mm_subs_epu8(p, a), _mm_subs_epu8(a, p));
+        __m128i const over =
+            _mm_subs_epu8(d, _mm_set1_epi8((char)MIN(f->tol, 0xFF)));
+        eq = _mm_cmpeq_epi32(over, _mm_setzero_si128());
+    } else {
+        eq = _mm_cmpeq_epi32(p, a);
+    }
+    return (u32)_mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+#endif
+
+// walks row y from x towards end (inclusive) while pixels match area color
+// as wanted, returns first position that differs or end + dir
+static i32
+flood_scan(struct Flood const* f, i32 x, i32 y, i32 end, i32 dir, Bool want) {
+    struct Raster const* rs = f->rs;
+    u64 const* filled =
+        f->filled_dyn ? &f->filled_dyn[(usize)y * f->row_words] : NULL;
+    while (dir > 0 ? x <= end : x >= end) {
+        i32 const tile_l = x & ~TILE_MASK;
+        i32 const seg_end =
+            dir > 0 ? MIN(end, tile_l + TILE_MASK) : MAX(end, tile_l);
+        u32 span_len = 0;
+        argb const* px = raster_span(rs, tile_l, y, &span_len);
+        if (!px) {
+            // empty tile is never written, so holds no filled pixels
+            if (flood_col(f, rs->empty) != want) {
+                return x;
+            }
+            x = seg_end + dir;
+            continue;
+        }
+        px -= tile_l;
+#ifdef __SSE2__
+        // forward scans cover most pixels, check 4 at once
+        u32 const all = want ? 0xF : 0;
+        while (dir > 0 && x + 3 <= seg_end) {
+            u32 const bit = x & 63;
+            u32 m = flood_col4(f, &px[x]);
+            if (filled) {
+                u64 const word = filled[x >> 6];
+                if (!want && !bit && x + 63 <= seg_end && word == ~(u64)0) {
+                    x += 64;
+                    continue;
+                }
+                // next word exists, x + 3 is inside row
+                u64 const bits =
+                    bit > 60 ? word >> bit | filled[(x >> 6) + 1] << (64 - bit)
+                             : word >> bit;
+                m &= ~(u32)bits & 0xF;
+            }
+            if (m != all) {
+                break;
+            }
+            x += 4;
+        }
+#endif
+        for (; dir > 0 ? x <= seg_end : x >= seg_end; x += dir) {
+            Bool m = True;
+            if (filled) {
+                u64 const word = filled[x >> 6];
+                if (word == ~(u64)0) {
+                    if (want) {
+                        return x;
+                    }
+                    // whole word filled, skip to its last bit in direction
+                    x = dir > 0 ? MIN(x | 63, seg_end) : MAX(x & ~63, seg_end);
+                    continue;
+                }
+                m = !(word >> (x & 63) & 1);
+            }
+            if ((m && flood_col(f, px[x])) != want) {
+                return x;
+            }
+        }
     }
+    return x;
+}
 
-    static i32 const d_rows[] = {1, 0, 0, -1};
-    static i32 const d_cols[] = {0, 1, -1, 0};
+static void flood_mark(struct Flood* f, i32 l, i32 r, i32 y) {
+    u64* row = &f->filled_dyn[(usize)y * f->row_words];
+    for (i32 x = l; x <= r;) {
+        u32 const bit = x & 63;
+        u32 const n = MIN(64 - bit, (u32)(r - x + 1));
+        row[x >> 6] |= (n == 64 ? ~(u64)0 : (((u64)1 << n) - 1)) << bit;
+        x += (i32)n;
+    }
+}
 
-    argb const area_col = XGetPixel(im, x, y);
-    if (area_col == targ_col) {
+// scanline fill over tile rows, stack holds one seed per run of unfilled
+// pixels
+static void
+flood_fill(struct Raster* rs, argb targ_col, i32 x, i32 y, u32 tol) {
+    if (x < 0 || y < 0 || x >= rs->w || y >= rs->h) {
         return;
     }
 
-    Pair* queue_arr = NULL;
-    Pair first = {x, y};
-    arrpush(queue_arr, first);
-
-    while (arrlen(queue_arr)) {
-        Pair curr = arrpop(queue_arr);
+    struct Flood f = {
+        .rs = rs,
+        .area_col = raster_get(rs, x, y),
+        .tol = tol,
+        .row_words = (rs->w + 63) / 64,
+    };
+    if (tol == 0 && f.area_col == targ_col) {
+        return;
+    }
+    // filled pixels may still match area_col when tolerance used
+    if (tol) {
+        f.filled_dyn = ecalloc(f.row_words * rs->h, sizeof(u64));
+    }
 
-        for (i32 dir = 0; dir < 4; ++dir) {
-            Pair d_curr = {curr.x + d_rows[dir], curr.y + d_cols[dir]};
+    Pair* seeds_arr = NULL;
+    arrpush(seeds_arr, ((Pair) {x, y}));
 
-            if (d_curr.x < 0 || d_curr.y < 0 || d_curr.x >= im->width
-                || d_curr.y >= im->height) {
+    while (arrlen(seeds_arr)) {
+        Pair const seed = arrpop(seeds_arr);
+        if (flood_scan(&f, seed.x, seed.y, seed.x, 1, True) == seed.x) {
+            continue;  // filled by other run
+        }
+        i32 const l = flood_scan(&f, seed.x, seed.y, 0, -1, True) + 1;
+        i32 const r =
+            flood_scan(&f, seed.x, seed.y, (i32)rs->w - 1, 1, True) - 1;
+        raster_fill_span(rs, l, seed.y, r - l + 1, targ_col);
+        if (f.filled_dyn) {
+            flood_mark(&f, l, r, seed.y);
+        }
+        // seed each run in rows above and below
+        for (i32 ny = seed.y - 1; ny <= seed.y + 1; ny += 2) {
+            if (ny < 0 || ny >= rs->h) {
                 continue;
             }
-
-            if (XGetPixel(im, d_curr.x, d_curr.y) == area_col) {
-                XPutPixel(im, d_curr.x, d_curr.y, targ_col);
-                arrpush(queue_arr, d_curr);
+            for (i32 i = l; i <= r;) {
+                i = flood_scan(&f, i, ny, r, 1, False);
+                if (i <= r) {
+                    arrpush(seeds_arr, ((Pair) {i, ny}));
+                    i = flood_scan(&f, i, ny, r, 1, True);
+                }
             }
         }
     }
 
-    arrfree(queue_arr);
+    arrfree(seeds_arr);
+    free(f.filled_dyn);
 }
 
 void tool_fill_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
@@ -1641,7 +2650,14 @@ void tool_fill_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
     }
     Pair const pointer = point_from_scr_to_cv_xy(dc, event->x, event->y);
 
-    flood_fill(dc->cv.im, *tc_curr_col(tc), pointer.x, pointer.y);
+    op_do(
+        ctx,
+        &(struct Op) {
+            .t = Op_Fill,
+            .col = *tc_curr_col(tc),
+            .d.fill = {pointer, tc->sdata.fill_tol},
+        }
+    );
 }
 
 void tool_picker_on_release(
@@ -1655,9 +2671,9 @@ void tool_picker_on_release(
     if (point_in_rect(
             pointer,
             (Pair) {0, 0},
-            (Pair) {(i32)dc->cv.im->width, (i32)dc->cv.im->height}
+            (Pair) {(i32)dc->cv.rs.w, (i32)dc->cv.rs.h}
         )) {
-        *tc_curr_col(tc) = XGetPixel(dc->cv.im, pointer.x, pointer.y);
+        *tc_curr_col(tc) = raster_get(&dc->cv.rs, pointer.x, pointer.y);
     }
 }
 
@@ -1667,237 +2683,1438 @@ Bool history_move(struct Ctx* ctx, Bool forward) {
     struct History** hist_save =
         forward ? &ctx->hist_nextarr : &ctx->hist_prevarr;
 
+    history_commit(ctx);
+    if (ctx->oplog.interval) {
+        return oplog_move(ctx, forward);
+    }
     if (!arrlenu(*hist_pop)) {
         return False;
     }
 
     struct History curr = arrpop(*hist_pop);
-    history_push(hist_save, ctx);
-
     history_apply(ctx, &curr);
+    curr.used = ++ctx->hist_clock;
+    arrpush(*hist_save, curr);
 
     return True;
 }
 
-void history_push(struct History** hist, struct Ctx* ctx) {
-    trace("xpaint: history push");
-    arrpush(*hist, history_clone(&(struct History) {.im = ctx->dc.cv.im}));
+// arms recording of user action, nothing is captured until first write
+void history_forward(struct Ctx* ctx) {
+    struct Raster* rs = &ctx->dc.cv.rs;
+    history_commit(ctx);
+    if (ctx->oplog.interval && !arrlenu(ctx->oplog.checkpoints_arr)) {
+        oplog_checkpoint(ctx);  // canvas before first logged action
+    }
+    ctx->hist_curr = (struct History) {
+        .w = rs->w,
+        .h = rs->h,
+        .empty = rs->empty,
+        .track_only = ctx->oplog.interval != 0,
+    };
+    rs->rec = &ctx->hist_curr;
 }
 
-void history_forward(struct Ctx* ctx) {
-    // next history invalidated after user action
-    historyarr_clear(ctx->dc.dp, &ctx->hist_nextarr);
-    history_push(&ctx->hist_prevarr, ctx);
+// ends recording, action without changes leaves no entry
+void history_commit(struct Ctx* ctx) {
+    struct History* hist = &ctx->hist_curr;
+    ctx->dc.cv.rs.rec = NULL;
+    free(hist->recorded_dyn);
+    hist->recorded_dyn = NULL;
+    if (hist->track_only) {
+        // ops recorded by action that changed nothing are dropped
+        if (arrlenu(hist->tiles_arr)) {
+            oplog_commit(ctx, hist->whole);
+        }
+        arrsetlen(ctx->oplog.curr_arr, 0);
+        history_free(&ctx->spill, hist);
+        return;
+    }
+    if (arrlenu(hist->tiles_arr)) {
+        // next history invalidated only by action that changed canvas
+        historyarr_clear(&ctx->spill, &ctx->hist_nextarr);
+        trace("xpaint: history push %td tiles", arrlen(hist->tiles_arr));
+        hist->used = ++ctx->hist_clock;
+        arrpush(ctx->hist_prevarr, *hist);
+        ctx->spill.failed = False;
+    }
+    *hist = (struct History) {0};
 }
 
+// exchanges canvas with recorded state
 void history_apply(struct Ctx* ctx, struct History* hist) {
-    XDestroyImage(ctx->dc.cv.im);
-    ctx->dc.cv.im = hist->im;
+    struct Raster* rs = &ctx->dc.cv.rs;
+    history_unspill(&ctx->spill, hist);
+    ctx->spill.failed = False;
+    for (u32 i = 0; i < hist->packed; ++i) {
+        history_tile_unpack(&hist->tiles_arr[i]);
+        hist->tiles_arr[i].deferred = False;
+    }
+    hist->packed = 0;  // gets canvas tiles, compress them again later
+    hist->deferred = 0;
+    if (hist->w == rs->w && hist->h == rs->h && hist->empty == rs->empty) {
+        for (u32 i = 0; i < arrlenu(hist->tiles_arr); ++i) {
+            struct HistTile* ht = &hist->tiles_arr[i];
+            struct Tile* t = &rs->tiles[ht->idx];
+            argb* const px = t->px;
+            t->px = ht->px;
+            ht->px = px;
+            t->gen = ++last_tile_gen;
+            t->dirty = True;
+        }
+        return;
+    }
+
+    // whole canvas replaced, entry holds every tile
+    struct History prev = *hist;
+    assert(
+        arrlenu(prev.tiles_arr)
+        == ((prev.w + TILE_MASK) >> TILE_SIZE_LOG2)
+               * ((prev.h + TILE_MASK) >> TILE_SIZE_LOG2)
+    );
+    *hist = (struct History) {
+        .w = rs->w,
+        .h = rs->h,
+        .empty = rs->empty,
+        .whole = True,
+    };
+    for (u32 i = 0; i < rs->tw * rs->th; ++i) {
+        arrpush(
+            hist->tiles_arr,
+            ((struct HistTile) {
+                .idx = i,
+                .px = rs->tiles[i].px,
+                .spill_off = SIZE_MAX,
+            })
+        );
+        rs->tiles[i].px = NULL;
+    }
+    raster_free(rs);
+    raster_init(rs, prev.w, prev.h, prev.empty);
+    for (u32 i = 0; i < arrlenu(prev.tiles_arr); ++i) {
+        rs->tiles[prev.tiles_arr[i].idx].px = prev.tiles_arr[i].px;
+    }
+    arrfree(prev.tiles_arr);
 }
 
-Bool history_restore(struct Ctx* ctx) {
-    if (!arrlen(ctx->hist_prevarr)) {
-        return False;
+void history_record_tile(
+    struct History* hist,
+    struct Raster const* rs,
+    u32 idx
+) {
+    if (hist->whole) {
+        return;
     }
-    struct History hist = history_clone(&arrlast(ctx->hist_prevarr));
-    history_apply(ctx, &hist);
-    return True;
+    if (!hist->recorded_dyn) {
+        u32 const tiles = ((hist->w + TILE_MASK) >> TILE_SIZE_LOG2)
+                          * ((hist->h + TILE_MASK) >> TILE_SIZE_LOG2);
+        hist->recorded_dyn = ecalloc((tiles + 7) / 8, sizeof(u8));
+    }
+    if (hist->recorded_dyn[idx / 8] & (1 << (idx % 8))) {
+        return;
+    }
+    hist->recorded_dyn[idx / 8] |= 1 << (idx % 8);
+    // canvas copies tile on write, until then both share it
+    argb* px = hist->track_only ? NULL : tile_px_ref(rs->tiles[idx].px);
+    arrpush(
+        hist->tiles_arr,
+        ((struct HistTile) {.idx = idx, .px = px, .spill_off = SIZE_MAX})
+    );
 }
 
-struct History history_clone(struct History const* hist) {
-    struct History result;
-    result.im = XSubImage(hist->im, 0, 0, hist->im->width, hist->im->height);
+// before changing size or empty color of raster
+void history_record_all(struct History* hist, struct Raster const* rs) {
+    for (u32 i = 0; i < rs->tw * rs->th; ++i) {
+        history_record_tile(hist, rs, i);
+    }
+    hist->whole = True;
+}
 
-    return result;
+void history_free(struct Spill* sp, struct History* hist) {
+    for (u32 i = 0; i < arrlenu(hist->tiles_arr); ++i) {
+        struct HistTile const* ht = &hist->tiles_arr[i];
+        if (hist->spilled && ht->spill_off != SIZE_MAX) {
+            spill_release(sp, ht->spill_off, history_tile_len(ht));
+        }
+        tile_px_unref(hist->tiles_arr[i].px);
+        free(hist->tiles_arr[i].rle_dyn);
+    }
+    arrfree(hist->tiles_arr);
+    free(hist->recorded_dyn);
+    *hist = (struct History) {0};
 }
 
-void historyarr_clear(Display* dp, struct History** histarr) {
+void historyarr_clear(struct Spill* sp, struct History** histarr) {
     for (u32 i = 0; i < arrlenu(*histarr); ++i) {
-        struct History* h = &(*histarr)[i];
-        XDestroyImage(h->im);
+        history_free(sp, &(*histarr)[i]);
     }
     arrfree(*histarr);
 }
 
-Bool ximage_put_checked(XImage* im, u32 x, u32 y, argb col) {
-    if (x >= im->width || y >= im->height) {
-        return False;
+// compresses one tile of stored history or spills least recently used
+// entry over resident limit, returns False if nothing left
+Bool history_idle_step(struct Ctx* ctx) {
+    struct Raster const* rs = &ctx->dc.cv.rs;
+    struct History* stacks[] = {ctx->hist_prevarr, ctx->hist_nextarr};
+    for (u32 s = 0; s < LENGTH(stacks); ++s) {
+        for (u32 i = 0; i < arrlenu(stacks[s]); ++i) {
+            struct History* hist = &stacks[s][i];
+            if (hist->packed < arrlenu(hist->tiles_arr)) {
+                struct HistTile* ht = &hist->tiles_arr[hist->packed++];
+                if (!history_tile_pack(hist, ht, rs)) {
+                    ht->deferred = True;
+                    ++hist->deferred;
+                }
+                if (hist->packed == arrlenu(hist->tiles_arr)) {
+                    history_evict(ctx);  // entry size is final now
+                }
+                return True;
+            }
+        }
     }
 
-    XPutPixel(im, x, y, col);
-    return True;
-}
-
-static u8 canvas_brush_get_a(struct Ctx* ctx, double r, Pair p) {
-    double const curr_r = sqrt((p.x - r) * (p.x - r) + (p.y - r) * (p.y - r));
-    return (u32)((1.0 - brush_ease(curr_r / r)) * 0xFF);
-}
+    // tiles canvas held when visited are retried after it lets any go
+    if (ctx->hist_unshares != tile_unshares) {
+        for (u32 s = 0; s < LENGTH(stacks); ++s) {
+            for (u32 i = 0; i < arrlenu(stacks[s]); ++i) {
+                struct History* hist = &stacks[s][i];
+                for (u32 t = 0; hist->deferred && t < arrlenu(hist->tiles_arr);
+                     ++t) {
+                    struct HistTile* ht = &hist->tiles_arr[t];
+                    if (!ht->deferred || history_tile_on_canvas(hist, ht, rs)) {
+                        continue;
+                    }
+                    ht->deferred = False;
+                    --hist->deferred;
+                    if (hist->spilled) {
+                        history_spill_tile(&ctx->spill, hist, ht, rs);
+                    } else {
+                        history_tile_pack(hist, ht, rs);
+                    }
+                    return True;
+                }
+            }
+        }
+        ctx->hist_unshares = tile_unshares;
+    }
 
-void canvas_draw_fn_brush(struct Ctx* ctx, Pair c) {
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    canvas_circle(
-        ctx,
-        c,
-        tc->sdata.line_w,
-        *tc_curr_col(tc),
-        &canvas_brush_get_a
-    );
+    u32 resident = 0;
+    struct History* lru = NULL;
+    for (u32 s = 0; s < LENGTH(stacks); ++s) {
+        for (u32 i = 0; i < arrlenu(stacks[s]); ++i) {
+            struct History* hist = &stacks[s][i];
+            if (!hist->spilled) {
+                ++resident;
+                lru = !lru || hist->used < lru->used ? hist : lru;
+            }
+        }
+    }
+    return resident > ctx->hist_resident
+        && history_spill(&ctx->spill, lru, rs);
 }
 
-void canvas_draw_fn_pencil(struct Ctx* ctx, Pair c) {
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    i32 const w = (i32)tc->sdata.line_w;
-    canvas_fill_rect(
-        ctx,
-        (Pair) {c.x - w / 2, c.y - w / 2},
-        (Pair) {w, w},
-        *tc_curr_col(tc)
+// moves tile data to spill file, entry stays in memory on failure
+Bool history_spill(
+    struct Spill* sp,
+    struct History* hist,
+    struct Raster const* rs
+) {
+    if (sp->failed || (sp->fd < 0 && !spill_open(sp))) {
+        sp->failed = True;
+        return False;
+    }
+    u32 const tiles_len = arrlenu(hist->tiles_arr);
+    for (u32 i = 0; i < tiles_len; ++i) {
+        struct HistTile* ht = &hist->tiles_arr[i];
+        void const* data = ht->rle_dyn ? (void*)ht->rle_dyn : (void*)ht->px;
+        usize const len = history_tile_len(ht);
+        ht->spill_off = SIZE_MAX;
+        if (history_tile_on_canvas(hist, ht, rs)) {
+            // spilling frees nothing while canvas holds it
+            if (!ht->deferred) {
+                ht->deferred = True;
+                ++hist->deferred;
+            }
+            continue;
+        }
+        if (data && !spill_alloc(sp, len, &ht->spill_off)) {
+            // release what was written so far
+            for (u32 j = 0; j < i; ++j) {
+                struct HistTile* done = &hist->tiles_arr[j];
+                if (done->spill_off != SIZE_MAX) {
+                    spill_release(sp, done->spill_off, history_tile_len(done));
+                }
+            }
+            sp->failed = True;
+            return False;
+        }
+        if (data) {
+            memcpy(sp->map + ht->spill_off, data, len);
+        }
+    }
+    for (u32 i = 0; i < tiles_len; ++i) {
+        struct HistTile* ht = &hist->tiles_arr[i];
+        if (ht->spill_off != SIZE_MAX) {
+            tile_px_unref(ht->px);
+            ht->px = NULL;
+            free(ht->rle_dyn);
+            ht->rle_dyn = NULL;
+            // deferred earlier, but canvas has dropped it since
+            if (ht->deferred) {
+                ht->deferred = False;
+                --hist->deferred;
+            }
+        }
+    }
+    hist->spilled = True;
+    trace("xpaint: history entry spilled, %u tiles", tiles_len);
+    return True;
+}
+
+// spills tile of spilled entry that canvas no longer holds
+void history_spill_tile(
+    struct Spill* sp,
+    struct History const* hist,
+    struct HistTile* ht,
+    struct Raster const* rs
+) {
+    history_tile_pack(hist, ht, rs);
+    usize const len = history_tile_len(ht);
+    usize off = 0;
+    if (sp->failed || !spill_alloc(sp, len, &off)) {
+        sp->failed = True;
+        return;  // stays resident, entry is still usable
+    }
+    if (ht->rle_dyn) {
+        memcpy(sp->map + off, ht->rle_dyn, len);
+        free(ht->rle_dyn);
+        ht->rle_dyn = NULL;
+    } else {
+        memcpy(sp->map + off, ht->px, len);
+        tile_px_unref(ht->px);
+        ht->px = NULL;
+    }
+    ht->spill_off = off;
+}
+
+void history_unspill(struct Spill* sp, struct History* hist) {
+    if (!hist->spilled) {
+        return;
+    }
+    for (u32 i = 0; i < arrlenu(hist->tiles_arr); ++i) {
+        struct HistTile* ht = &hist->tiles_arr[i];
+        if (ht->spill_off == SIZE_MAX) {
+            continue;
+        }
+        usize const len = history_tile_len(ht);
+        if (ht->rle_len) {
+            ht->rle_dyn = ecalloc(len, 1);
+            memcpy(ht->rle_dyn, sp->map + ht->spill_off, len);
+        } else {
+            ht->px = tile_px_new();
+            memcpy(ht->px, sp->map + ht->spill_off, len);
+        }
+        spill_release(sp, ht->spill_off, len);
+        ht->spill_off = SIZE_MAX;
+    }
+    hist->spilled = False;
+}
+
+// data size of non-empty tile, compressed or not
+usize history_tile_len(struct HistTile const* ht) {
+    return ht->rle_len ? ht->rle_len * sizeof(u32) : TILE_PX * sizeof(argb);
+}
+
+Bool spill_open(struct Spill* sp) {
+    char const* dir = COALESCE(getenv("XDG_RUNTIME_DIR"), "/tmp");
+    for (u32 attempt = 0; attempt < 16 && sp->fd < 0; ++attempt) {
+        char* path_dyn = str_new("%s/xpaint-%d-%u.swp", dir, getpid(), attempt);
+        sp->fd = open(path_dyn, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (sp->fd >= 0) {
+            unlink(path_dyn);  // freed by system when closed
+        }
+        str_free(&path_dyn);
+    }
+    if (sp->fd < 0) {
+        trace("xpaint: can't create history spill file in %s", dir);
+        return False;
+    }
+    return True;
+}
+
+Bool spill_alloc(struct Spill* sp, usize len, usize* off) {
+    for (u32 i = 0; i < arrlenu(sp->free_arr); ++i) {
+        struct Extent* e = &sp->free_arr[i];
+        if (e->len >= len) {
+            *off = e->off;
+            e->off += len;
+            e->len -= len;
+            if (!e->len) {
+                arrdel(sp->free_arr, i);
+            }
+            return True;
+        }
+    }
+
+    if (sp->top + len > sp->size) {
+        usize const size = MAX(MAX(sp->size * 2, sp->top + len), 1 << 24);
+        // blocks are reserved now, writing through mapping into sparse
+        // file would raise SIGBUS when disk is full
+        i32 const err = posix_fallocate(
+            sp->fd,
+            (off_t)sp->size,
+            (off_t)(size - sp->size)
+        );
+        if (err) {
+            trace("xpaint: can't grow history spill file: %s", strerror(err));
+            return False;
+        }
+        u8* map =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, 0);
+        if (map == MAP_FAILED) {
+            trace("xpaint: can't map history spill file");
+            return False;
+        }
+        if (sp->map) {
+            munmap(sp->map, sp->size);
+        }
+        sp->map = map;
+        sp->size = size;
+    }
+    *off = sp->top;
+    sp->top += len;
+    return True;
+}
+
+void spill_release(struct Spill* sp, usize off, usize len) {
+    sp->failed = False;  // freed space may fit next spill
+    u32 i = 0;
+    while (i < arrlenu(sp->free_arr) && sp->free_arr[i].off < off) {
+        ++i;
+    }
+    arrins(sp->free_arr, i, ((struct Extent) {off, len}));
+    // coalesce with neighbours
+    if (i + 1 < arrlenu(sp->free_arr)
+        && off + len == sp->free_arr[i + 1].off) {
+        sp->free_arr[i].len += sp->free_arr[i + 1].len;
+        arrdel(sp->free_arr, i + 1);
+    }
+    if (i && sp->free_arr[i - 1].off + sp->free_arr[i - 1].len == off) {
+        sp->free_arr[i - 1].len += sp->free_arr[i].len;
+        arrdel(sp->free_arr, i);
+        --i;
+    }
+    struct Extent const last = sp->free_arr[i];
+    if (i + 1 == arrlenu(sp->free_arr) && last.off + last.len == sp->top) {
+        sp->top = last.off;
+        arrdel(sp->free_arr, i);
+    }
+}
+
+usize spill_usage(struct Spill const* sp) {
+    usize result = sp->top;
+    for (u32 i = 0; i < arrlenu(sp->free_arr); ++i) {
+        result -= sp->free_arr[i].len;
+    }
+    return result;
+}
+
+void spill_close(struct Spill* sp) {
+    if (sp->map) {
+        munmap(sp->map, sp->size);
+    }
+    if (sp->fd >= 0) {
+        close(sp->fd);
+    }
+    arrfree(sp->free_arr);
+    *sp = (struct Spill) {.fd = -1};
+}
+
+// whether canvas holds pixels of entry tile; grids are anchored at
+// origin and tiles never move between positions, so only tile at same
+// position of current grid can
+Bool history_tile_on_canvas(
+    struct History const* hist,
+    struct HistTile const* ht,
+    struct Raster const* rs
+) {
+    u32 const tw = (hist->w + TILE_MASK) >> TILE_SIZE_LOG2;
+    u32 const tx = ht->idx % tw;
+    u32 const ty = ht->idx / tw;
+    return ht->px && tx < rs->tw && ty < rs->th
+        && rs->tiles[ty * rs->tw + tx].px == ht->px;
+}
+
+// keeps tile uncompressed if runs don't halve its size or canvas still
+// holds it, False in latter case; pixels shared only with other entries
+// are compressed, they are freed once every entry did so
+Bool history_tile_pack(
+    struct History const* hist,
+    struct HistTile* ht,
+    struct Raster const* rs
+) {
+    argb const* px = ht->px;
+    if (!px) {
+        return True;
+    }
+    if (history_tile_on_canvas(hist, ht, rs)) {
+        return False;
+    }
+    u32 runs = 1;
+    for (u32 i = 1; i < TILE_PX && runs * 4 < TILE_PX; ++i) {
+        runs += px[i] != px[i - 1];
+    }
+    if (runs * 4 >= TILE_PX) {
+        return True;
+    }
+    ht->rle_len = runs * 2;
+    ht->rle_dyn = ecalloc(ht->rle_len, sizeof(u32));
+    u32* out = ht->rle_dyn;
+    out[0] = 1;
+    out[1] = px[0];
+    for (u32 i = 1; i < TILE_PX; ++i) {
+        if (px[i] == out[1]) {
+            ++out[0];
+        } else {
+            out += 2;
+            out[0] = 1;
+            out[1] = px[i];
+        }
+    }
+    assert(out + 2 == ht->rle_dyn + ht->rle_len);
+    tile_px_unref(ht->px);
+    ht->px = NULL;
+    return True;
+}
+
+void history_tile_unpack(struct HistTile* ht) {
+    if (!ht->rle_dyn) {
+        return;
+    }
+    ht->px = tile_px_new();
+    argb* out = ht->px;
+    for (u32 i = 0; i < ht->rle_len; i += 2) {
+        for (u32 n = 0; n < ht->rle_dyn[i]; ++n) {
+            *out++ = ht->rle_dyn[i + 1];
+        }
+    }
+    assert(out == ht->px + TILE_PX);
+    free(ht->rle_dyn);
+    ht->rle_dyn = NULL;
+    ht->rle_len = 0;
+}
+
+static int px_ptr_cmp(void const* a, void const* b) {
+    uintptr_t const pa = (uintptr_t)*(argb* const*)a;
+    uintptr_t const pb = (uintptr_t)*(argb* const*)b;
+    return (pa > pb) - (pa < pb);
+}
+
+// pixels shared only by several entries are counted once, ones canvas
+// holds cost nothing extra
+usize history_usage(struct Ctx const* ctx) {
+    struct Raster const* rs = &ctx->dc.cv.rs;
+    struct History const* stacks[] = {ctx->hist_prevarr, ctx->hist_nextarr};
+    argb** shared_arr = NULL;
+    usize result = 0;
+    for (u32 s = 0; s < LENGTH(stacks); ++s) {
+        for (u32 i = 0; i < arrlenu(stacks[s]); ++i) {
+            struct History const* hist = &stacks[s][i];
+            result += arrlenu(hist->tiles_arr) * sizeof(struct HistTile);
+            for (u32 t = 0; t < arrlenu(hist->tiles_arr); ++t) {
+                struct HistTile const* ht = &hist->tiles_arr[t];
+                result += ht->rle_dyn ? ht->rle_len * sizeof(u32) : 0;
+                if (!ht->px || history_tile_on_canvas(hist, ht, rs)) {
+                    continue;
+                }
+                if (tile_px_refs(ht->px) > 1) {
+                    arrpush(shared_arr, ht->px);
+                } else {
+                    result += TILE_PX * sizeof(argb);
+                }
+            }
+        }
+    }
+    if (shared_arr) {
+        qsort(shared_arr, arrlenu(shared_arr), sizeof(argb*), &px_ptr_cmp);
+    }
+    for (u32 i = 0; i < arrlenu(shared_arr); ++i) {
+        if (!i || shared_arr[i] != shared_arr[i - 1]) {
+            result += TILE_PX * sizeof(argb);
+        }
+    }
+    arrfree(shared_arr);
+    return result;
+}
+
+// drops oldest undo entries, then farthest redo ones, until under budget.
+// last action always stays undoable
+void history_evict(struct Ctx* ctx) {
+    usize const budget = (usize)ctx->hist_budget_mb << 20;
+    usize usage = history_usage(ctx);
+    while (usage > budget
+           && (arrlenu(ctx->hist_prevarr) > 1 || arrlenu(ctx->hist_nextarr))) {
+        struct History** histarr = arrlenu(ctx->hist_prevarr) > 1
+                                       ? &ctx->hist_prevarr
+                                       : &ctx->hist_nextarr;
+        history_free(&ctx->spill, &(*histarr)[0]);
+        arrdel(*histarr, 0);
+        // pixels it shared with other entries stay
+        usage = history_usage(ctx);
+        trace("xpaint: history entry evicted, %zu bytes left", usage);
+    }
+}
+
+// performs canvas operation of user action, logging it if enabled
+void op_do(struct Ctx* ctx, struct Op const* op) {
+    op_run(ctx, op);
+    if (ctx->oplog.interval && ctx->dc.cv.rs.rec) {
+        arrpush(ctx->oplog.curr_arr, *op);
+    }
+}
+
+void op_run(struct Ctx* ctx, struct Op const* op) {
+    struct Raster* rs = &ctx->dc.cv.rs;
+    switch (op->t) {
+        case Op_Dot: {
+            Pair const c = op->d.draw.from;
+            if (op->d.draw.soft) {
+                canvas_circle(ctx, c, op->line_w, op->col, &canvas_brush_get_a);
+            } else {
+                i32 const w = (i32)op->line_w;
+                canvas_fill_rect(
+                    rs,
+                    (Pair) {c.x - w / 2, c.y - w / 2},
+                    (Pair) {w, w},
+                    op->col
+                );
+            }
+        } break;
+        case Op_Segment: {
+            struct OpDDraw const* d = &op->d.draw;
+            if (d->soft) {
+                canvas_stroke_soft(ctx, d->from, d->to, op->line_w, op->col);
+            } else {
+                canvas_stroke_square(rs, d->from, d->to, op->line_w, op->col);
+            }
+        } break;
+        case Op_Figure: {
+            struct OpDFigure const* d = &op->d.figure;
+            canvas_figure(rs, &d->fig, op->col, op->line_w, d->p1, d->p2);
+        } break;
+        case Op_Fill: {
+            struct OpDFill const* d = &op->d.fill;
+            flood_fill(rs, op->col, d->seed.x, d->seed.y, d->tol);
+        } break;
+        case Op_Copy: {
+            struct OpDCopy const* d = &op->d.copy;
+            canvas_copy_region(ctx, d->from, d->dims, d->to, d->clear_source);
+        } break;
+    }
+}
+
+// actions changing canvas size or without logged ops (image load, resize)
+// are opaque
+void oplog_commit(struct Ctx* ctx, Bool opaque) {
+    struct OpLog* log = &ctx->oplog;
+    // undone actions are replaced by new one
+    for (u32 i = log->pos; i < arrlenu(log->actions_arr); ++i) {
+        arrfree(log->actions_arr[i].ops_arr);
+    }
+    arrsetlen(log->actions_arr, log->pos);
+    while (arrlast(log->checkpoints_arr).pos > log->pos) {
+        history_free(&ctx->spill, &arrlast(log->checkpoints_arr).hist);
+        arrsetlen(log->checkpoints_arr, arrlenu(log->checkpoints_arr) - 1);
+    }
+
+    struct Action action = {
+        .ops_arr = NULL,
+        .opaque = opaque || !arrlenu(log->curr_arr),
+    };
+    if (!action.opaque) {
+        arrsetlen(action.ops_arr, arrlenu(log->curr_arr));
+        memcpy(
+            action.ops_arr,
+            log->curr_arr,
+            arrlenu(log->curr_arr) * sizeof(struct Op)
+        );
+    }
+    arrpush(log->actions_arr, action);
+    ++log->pos;
+    trace("xpaint: oplog action %u, %td ops", log->pos, arrlen(action.ops_arr));
+
+    if (action.opaque
+        || log->pos - arrlast(log->checkpoints_arr).pos >= log->interval) {
+        oplog_checkpoint(ctx);
+    }
+}
+
+// shares every canvas tile, costs memory only as canvas changes
+void oplog_checkpoint(struct Ctx* ctx) {
+    struct Raster const* rs = &ctx->dc.cv.rs;
+    struct Checkpoint cp = {
+        .pos = ctx->oplog.pos,
+        .hist = {.w = rs->w, .h = rs->h, .empty = rs->empty},
+    };
+    history_record_all(&cp.hist, rs);
+    free(cp.hist.recorded_dyn);
+    cp.hist.recorded_dyn = NULL;
+    arrpush(ctx->oplog.checkpoints_arr, cp);
+}
+
+void oplog_restore(struct Ctx* ctx, struct History const* cp) {
+    struct Raster* rs = &ctx->dc.cv.rs;
+    if (cp->w != rs->w || cp->h != rs->h) {
+        raster_free(rs);
+        raster_init(rs, cp->w, cp->h, cp->empty);
+    }
+    rs->empty = cp->empty;
+    for (u32 i = 0; i < arrlenu(cp->tiles_arr); ++i) {
+        struct Tile* t = &rs->tiles[cp->tiles_arr[i].idx];
+        tile_px_unref(t->px);
+        t->px = tile_px_ref(cp->tiles_arr[i].px);
+        t->gen = ++last_tile_gen;
+        t->dirty = True;
+    }
+}
+
+Bool oplog_move(struct Ctx* ctx, Bool undo) {
+    struct OpLog* log = &ctx->oplog;
+    u32 const target = undo ? log->pos - 1 : log->pos + 1;
+    if (undo ? !log->pos : log->pos == arrlenu(log->actions_arr)) {
+        return False;
+    }
+
+    // nearest checkpoint at or before target, opaque actions have own
+    u32 c = arrlenu(log->checkpoints_arr) - 1;
+    while (log->checkpoints_arr[c].pos > target) {
+        --c;
+    }
+    u32 from = log->pos;
+    if (undo || log->checkpoints_arr[c].pos == target) {
+        oplog_restore(ctx, &log->checkpoints_arr[c].hist);
+        from = log->checkpoints_arr[c].pos;
+    }
+    for (u32 i = from; i < target; ++i) {
+        struct Action const* action = &log->actions_arr[i];
+        assert(!action->opaque);
+        stroke_end(&ctx->stroke);
+        for (u32 j = 0; j < arrlenu(action->ops_arr); ++j) {
+            op_run(ctx, &action->ops_arr[j]);
+        }
+        stroke_end(&ctx->stroke);
+    }
+    log->pos = target;
+    return True;
+}
+
+void oplog_clear(struct OpLog* log) {
+    for (u32 i = 0; i < arrlenu(log->actions_arr); ++i) {
+        arrfree(log->actions_arr[i].ops_arr);
+    }
+    arrfree(log->actions_arr);
+    for (u32 i = 0; i < arrlenu(log->checkpoints_arr); ++i) {
+        history_free(NULL, &log->checkpoints_arr[i].hist);
+    }
+    arrfree(log->checkpoints_arr);
+    arrfree(log->curr_arr);
+    log->pos = 0;
+}
+
+// reference count lives in front of pixels, keeping them 16-byte aligned
+#define TILE_PX_HDR 16
+
+argb* tile_px_new(void) {
+    u8* mem = ecalloc(TILE_PX_HDR + TILE_PX * sizeof(argb), 1);
+    *(u32*)mem = 1;
+    return (argb*)(mem + TILE_PX_HDR);
+}
+
+argb* tile_px_ref(argb* px) {
+    if (px) {
+        ++*(u32*)((u8*)px - TILE_PX_HDR);
+    }
+    return px;
+}
+
+void tile_px_unref(argb* px) {
+    if (!px) {
+        return;
+    }
+    u32* const refs = (u32*)((u8*)px - TILE_PX_HDR);
+    if (!--*refs) {
+        free(refs);
+    } else {
+        ++tile_unshares;
+    }
+}
+
+u32 tile_px_refs(argb const* px) {
+    return *(u32 const*)((u8 const*)px - TILE_PX_HDR);
+}
+
+void raster_init(struct Raster* rs, u32 w, u32 h, argb empty) {
+    assert(w && h);
+    *rs = (struct Raster) {
+        .w = w,
+        .h = h,
+        .tw = (w + TILE_SIZE - 1) >> TILE_SIZE_LOG2,
+        .th = (h + TILE_SIZE - 1) >> TILE_SIZE_LOG2,
+        .empty = empty,
+    };
+    rs->tiles = ecalloc(rs->tw * rs->th, sizeof(struct Tile));
+    for (u32 i = 0; i < rs->tw * rs->th; ++i) {
+        rs->tiles[i].gen = ++last_tile_gen;
+    }
+    raster_touch_all(rs);
+}
+
+void raster_free(struct Raster* rs) {
+    if (rs->tiles) {
+        for (u32 i = 0; i < rs->tw * rs->th; ++i) {
+            tile_px_unref(rs->tiles[i].px);
+        }
+        free(rs->tiles);
+    }
+    *rs = (struct Raster) {0};
+}
+
+void raster_from_ximage(struct Raster* rs, XImage const* im) {
+    raster_init(rs, im->width, im->height, 0);
+    for (u32 ty = 0; ty < rs->th; ++ty) {
+        for (u32 tx = 0; tx < rs->tw; ++tx) {
+            argb* px = raster_tile_w(rs, tx, ty);
+            u32 const x0 = tx << TILE_SIZE_LOG2;
+            u32 const y0 = ty << TILE_SIZE_LOG2;
+            u32 const w = MIN(TILE_SIZE, rs->w - x0);
+            u32 const h = MIN(TILE_SIZE, rs->h - y0);
+            for (u32 y = 0; y < h; ++y) {
+                if (ximage_is_argb32(im)) {
+                    memcpy(
+                        &px[y * TILE_SIZE],
+                        ximage_row(im, (i32)(y0 + y)) + x0,
+                        w * sizeof(argb)
+                    );
+                    continue;
+                }
+                for (u32 x = 0; x < w; ++x) {
+                    px[y * TILE_SIZE + x] =
+                        XGetPixel((XImage*)im, (i32)(x0 + x), (i32)(y0 + y));
+                }
+            }
+        }
+    }
+}
+
+XImage* raster_to_ximage(
+    struct DrawCtx const* dc,
+    struct Raster const* rs,
+    Pair c,
+    Pair dims
+) {
+    XImage* result = XCreateImage(
+        dc->dp,
+        dc->vinfo.visual,
+        dc->vinfo.depth,
+        ZPixmap,
+        0,
+        ecalloc(dims.x * dims.y, sizeof(argb)),
+        dims.x,
+        dims.y,
+        32,
+        dims.x * (i32)sizeof(argb)
     );
+    if (ximage_is_argb32(result)) {
+        for (i32 y = 0; y < dims.y; ++y) {
+            raster_read_row(rs, c.x, c.y + y, dims.x, ximage_row(result, y));
+        }
+        return result;
+    }
+    for (i32 y = 0; y < dims.y; ++y) {
+        for (i32 x = 0; x < dims.x; ++x) {
+            XPutPixel(result, x, y, raster_get(rs, c.x + x, c.y + y));
+        }
+    }
+    return result;
 }
 
-static u8 canvas_figure_circle_get_a_fill(struct Ctx* ctx, double r, Pair p) {
-    return 0xFF;
+argb* raster_tile_w(struct Raster* rs, u32 tx, u32 ty) {
+    struct Tile* t = &rs->tiles[ty * rs->tw + tx];
+    if (rs->rec) {
+        history_record_tile(rs->rec, rs, ty * rs->tw + tx);
+    }
+    if (t->px && tile_px_refs(t->px) > 1) {
+        argb* px = tile_px_new();
+        memcpy(px, t->px, TILE_PX * sizeof(argb));
+        tile_px_unref(t->px);
+        t->px = px;
+    }
+    if (!t->px) {
+        t->px = tile_px_new();
+        argb const* base_px =
+            rs->base ? rs->base->tiles[ty * rs->tw + tx].px : NULL;
+        if (base_px) {
+            memcpy(t->px, base_px, TILE_PX * sizeof(argb));
+        } else {
+            pixels_fill(t->px, TILE_PX, rs->base ? rs->base->empty : rs->empty);
+        }
+    }
+    t->gen = ++last_tile_gen;
+    t->dirty = True;
+    return t->px;
 }
 
-static u8 canvas_figure_circle_get_a(struct Ctx* ctx, double r, Pair p) {
-    double const curr_r = sqrt((p.x - r) * (p.x - r) + (p.y - r) * (p.y - r));
-    // FIXME fixed border width (same as line_w)
-    return ((curr_r / r) > 0.9) * 0xFF;
+argb raster_get(struct Raster const* rs, i32 x, i32 y) {
+    assert(BETWEEN(x, 0, (i32)rs->w - 1) && BETWEEN(y, 0, (i32)rs->h - 1));
+    struct Tile const* t =
+        &rs->tiles[(y >> TILE_SIZE_LOG2) * rs->tw + (x >> TILE_SIZE_LOG2)];
+    return t->px ? t->px[(y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK)]
+                 : rs->empty;
 }
 
-void canvas_figure(struct Ctx* ctx, Pair p1, Pair p2) {
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    if (tc->t != Tool_Figure) {
+Bool raster_put(struct Raster* rs, i32 x, i32 y, argb col) {
+    if (x < 0 || y < 0 || x >= rs->w || y >= rs->h) {
+        return False;
+    }
+    argb* px = raster_tile_w(rs, x >> TILE_SIZE_LOG2, y >> TILE_SIZE_LOG2);
+    px[(y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK)] = col;
+    return True;
+}
+
+// pixels from (x, y) to end of tile row or raster, NULL if tile is empty
+argb const* raster_span(struct Raster const* rs, i32 x, i32 y, u32* len) {
+    assert(BETWEEN(x, 0, (i32)rs->w - 1) && BETWEEN(y, 0, (i32)rs->h - 1));
+    struct Tile const* t =
+        &rs->tiles[(y >> TILE_SIZE_LOG2) * rs->tw + (x >> TILE_SIZE_LOG2)];
+    *len = MIN(TILE_SIZE - (x & TILE_MASK), rs->w - x);
+    return t->px ? &t->px[(y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK)]
+                 : NULL;
+}
+
+// same as raster_span, but allocates tile and counts as write access
+argb* raster_span_w(struct Raster* rs, i32 x, i32 y, u32* len) {
+    assert(BETWEEN(x, 0, (i32)rs->w - 1) && BETWEEN(y, 0, (i32)rs->h - 1));
+    argb* px = raster_tile_w(rs, x >> TILE_SIZE_LOG2, y >> TILE_SIZE_LOG2);
+    *len = MIN(TILE_SIZE - (x & TILE_MASK), rs->w - x);
+    return &px[(y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK)];
+}
+
+void raster_read_row(
+    struct Raster const* rs,
+    i32 x,
+    i32 y,
+    u32 len,
+    argb* out
+) {
+    assert(x + len <= rs->w);
+    while (len != 0) {
+        u32 span_len = 0;
+        argb const* span = raster_span(rs, x, y, &span_len);
+        span_len = MIN(span_len, len);
+        if (span) {
+            memcpy(out, span, span_len * sizeof(argb));
+        } else {
+            pixels_fill(out, span_len, rs->empty);
+        }
+        out += span_len;
+        x += (i32)span_len;
+        len -= span_len;
+    }
+}
+
+// clipped like raster_put
+void raster_write_row(
+    struct Raster* rs,
+    i32 x,
+    i32 y,
+    u32 len,
+    argb const* in
+) {
+    if (y < 0 || y >= rs->h) {
+        return;
+    }
+    i32 const x_end = MIN(x + (i32)len, (i32)rs->w);
+    if (x < 0) {
+        in += -x;
+        x = 0;
+    }
+    while (x < x_end) {
+        u32 span_len = 0;
+        argb* span = raster_span_w(rs, x, y, &span_len);
+        span_len = MIN(span_len, (u32)(x_end - x));
+        memcpy(span, in, span_len * sizeof(argb));
+        in += span_len;
+        x += (i32)span_len;
+    }
+}
+
+// clipped like raster_put
+void raster_fill_span(struct Raster* rs, i32 x, i32 y, u32 len, argb col) {
+    if (y < 0 || y >= rs->h) {
         return;
     }
-    struct FigureData const* fig = &tc->d.fig;
-    argb const col = *tc_curr_col(tc);
+    i32 const x_end = MIN(x + (i32)len, (i32)rs->w);
+    x = MAX(x, 0);
+    while (x < x_end) {
+        u32 span_len = 0;
+        argb* span = raster_span_w(rs, x, y, &span_len);
+        span_len = MIN(span_len, (u32)(x_end - x));
+        pixels_fill(span, span_len, col);
+        x += (i32)span_len;
+    }
+}
+
+static i64 floor_div(i64 a, i64 b) {
+    assert(b > 0);
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// edge functions in SUBPX units sampled at pixel centers, each row is
+// filled as single span; top-left rule keeps shared edges of adjacent
+// triangles from being covered twice
+void raster_fill_triangle(struct Raster* rs, Pair const v[3], argb col) {
+    i64 const area = (i64)(v[1].x - v[0].x) * (v[2].y - v[0].y)
+                   - (i64)(v[1].y - v[0].y) * (v[2].x - v[0].x);
+    if (area == 0) {
+        return;
+    }
+    // inside points have all edge functions positive
+    Pair const p[3] = {v[0], area > 0 ? v[1] : v[2], area > 0 ? v[2] : v[1]};
+    struct Edge {
+        i64 dx;
+        i64 dy;
+        i64 bias;  // excludes points exactly on not top-left edge
+    } e[3];
+    for (i32 i = 0; i < 3; ++i) {
+        Pair const a = p[i];
+        Pair const b = p[(i + 1) % 3];
+        e[i].dx = b.x - a.x;
+        e[i].dy = b.y - a.y;
+        e[i].bias = (e[i].dy < 0 || (e[i].dy == 0 && e[i].dx > 0)) ? 0 : -1;
+    }
+
+    i32 const min_y = MIN(MIN(p[0].y, p[1].y), p[2].y);
+    i32 const max_y = MAX(MAX(p[0].y, p[1].y), p[2].y);
+    i32 const y_beg = (i32)MAX(floor_div(min_y, SUBPX), 0);
+    i32 const y_end = (i32)MIN(floor_div(max_y, SUBPX) + 1, (i64)rs->h);
+    for (i32 y = y_beg; y < y_end; ++y) {
+        i64 const py = (i64)y * SUBPX + SUBPX / 2;
+        i64 xl = 0;
+        i64 xr = (i64)rs->w - 1;  // inclusive
+        for (i32 i = 0; i < 3 && xl <= xr; ++i) {
+            // E(x) = dx * (py - a.y) - dy * (px - a.x) + bias as k * x + m
+            // with px = x * SUBPX + SUBPX / 2
+            i64 const k = -e[i].dy * SUBPX;
+            i64 const m = e[i].dx * (py - p[i].y)
+                        - e[i].dy * (SUBPX / 2 - p[i].x) + e[i].bias;
+            if (k > 0) {
+                xl = MAX(xl, -floor_div(m, k));
+            } else if (k < 0) {
+                xr = MIN(xr, floor_div(m, -k));
+            } else if (m < 0) {
+                xr = xl - 1;
+            }
+        }
+        if (xl <= xr) {
+            raster_fill_span(rs, (i32)xl, y, (u32)(xr - xl + 1), col);
+        }
+    }
+}
+
+void raster_fill(struct Raster* rs, argb col) {
+    if (rs->rec) {
+        history_record_all(rs->rec, rs);
+    }
+    // drop pixel data, all tiles become empty
+    for (u32 i = 0; i < rs->tw * rs->th; ++i) {
+        struct Tile* t = &rs->tiles[i];
+        tile_px_unref(t->px);
+        t->px = NULL;
+        t->gen = ++last_tile_gen;
+        t->dirty = True;
+    }
+    rs->empty = col;
+}
+
+void raster_resize(struct Raster* rs, u32 w, u32 h) {
+    if (rs->rec) {
+        history_record_all(rs->rec, rs);
+    }
+    struct Raster result;
+    raster_init(&result, w, h, rs->empty);
+    result.rec = rs->rec;
+    // tile grid anchored at origin, so common tiles just move
+    for (u32 ty = 0; ty < MIN(rs->th, result.th); ++ty) {
+        for (u32 tx = 0; tx < MIN(rs->tw, result.tw); ++tx) {
+            struct Tile* t = &rs->tiles[ty * rs->tw + tx];
+            result.tiles[ty * result.tw + tx].px = t->px;
+            t->px = NULL;
+        }
+    }
+    raster_free(rs);
+    *rs = result;
+}
+
+// content unchanged, but screen cache must be reuploaded
+void raster_touch_all(struct Raster* rs) {
+    for (u32 i = 0; i < rs->tw * rs->th; ++i) {
+        rs->tiles[i].dirty = True;
+    }
+}
+
+static u8 brush_alpha(double r_ratio) {
+    return (u32)((1.0 - brush_ease(r_ratio)) * 0xFF);
+}
+
+u8 canvas_brush_get_a(struct Ctx* ctx, double r, Pair p) {
+    double const curr_r = sqrt((p.x - r) * (p.x - r) + (p.y - r) * (p.y - r));
+    return brush_alpha(curr_r / r);
+}
+
+// drawer tools paint through recorded operations
+static void
+canvas_draw_op(struct Ctx* ctx, enum OpTag t, Pair a, Pair b, Bool soft) {
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    op_do(
+        ctx,
+        &(struct Op) {
+            .t = t,
+            .col = *tc_curr_col(tc),
+            .line_w = tc->sdata.line_w,
+            .d.draw = {a, b, soft},
+        }
+    );
+}
+
+void canvas_draw_fn_brush(struct Ctx* ctx, Pair c) {
+    canvas_draw_op(ctx, Op_Dot, c, c, True);
+}
+
+void canvas_draw_fn_pencil(struct Ctx* ctx, Pair c) {
+    canvas_draw_op(ctx, Op_Dot, c, c, False);
+}
+
+void canvas_stroke_fn_brush(struct Ctx* ctx, Pair from, Pair to) {
+    canvas_draw_op(ctx, Op_Segment, from, to, True);
+}
+
+void canvas_stroke_fn_pencil(struct Ctx* ctx, Pair from, Pair to) {
+    canvas_draw_op(ctx, Op_Segment, from, to, False);
+}
+
+void canvas_figure(
+    struct Raster* rs,
+    struct FigureData const* fig,
+    argb col,
+    u32 w,
+    Pair p1,
+    Pair p2
+) {
     i32 const dx = p1.x - p2.x;
     i32 const dy = p1.y - p2.y;
 
     switch (fig->curr) {
         case Figure_Circle: {
-            double const d = sqrt(dx * dx + dy * dy);
-            canvas_circle(
-                ctx,
-                (Pair) {(p1.x + p2.x) / 2, (p1.y + p2.y) / 2},
-                (u32)d,
+            i32 const r = (i32)lround(sqrt(dx * dx + dy * dy) * SUBPX / 2);
+            canvas_ellipse(
+                rs,
+                (Pair) {
+                    (p1.x + p2.x) * SUBPX / 2 + SUBPX / 2,
+                    (p1.y + p2.y) * SUBPX / 2 + SUBPX / 2,
+                },
+                (Pair) {r, r},
                 col,
-                fig->fill ? &canvas_figure_circle_get_a_fill
-                          : &canvas_figure_circle_get_a
+                w,
+                fig->fill
             );
         } break;
         case Figure_Rectangle: {
             if (fig->fill) {
-                canvas_fill_rect(ctx, p2, (Pair) {dx, dy}, col);
+                canvas_fill_rect(rs, p2, (Pair) {dx, dy}, col);
             } else {
-                canvas_rect(ctx, p2, (Pair) {dx, dy}, col, tc->sdata.line_w);
+                canvas_rect(rs, p2, (Pair) {dx, dy}, col, w);
             }
         } break;
         // FIXME combine with Figure_Rectangle? same signatures
         case Figure_Triangle: {
             if (fig->fill) {
-                canvas_fill_triangle(ctx, p2, (Pair) {dx, dy}, col);
+                canvas_fill_triangle(rs, p2, (Pair) {dx, dy}, col);
             } else {
                 canvas_triangle(
-                    ctx,
+                    rs,
                     p2,
                     (Pair) {dx, dy},
                     col,
-                    tc->sdata.line_w
+                    w
                 );
             }
         } break;
     }
 }
 
-void canvas_fill_rect(struct Ctx* ctx, Pair c, Pair dims, argb col) {
-    struct DrawCtx* dc = &ctx->dc;
-    Bool const nx = dims.x < 0;
-    Bool const ny = dims.y < 0;
-    for (i32 x = c.x + (nx ? dims.x : 0); x < c.x + (nx ? 0 : dims.x); ++x) {
-        for (i32 y = c.y + (ny ? dims.y : 0); y < c.y + (ny ? 0 : dims.y);
-             ++y) {
-            ximage_put_checked(dc->cv.im, x, y, col);
-        }
+void canvas_fill_rect(struct Raster* rs, Pair c, Pair dims, argb col) {
+    i32 const l = MAX(dims.x < 0 ? c.x + dims.x : c.x, 0);
+    i32 const t = MAX(dims.y < 0 ? c.y + dims.y : c.y, 0);
+    i32 const r = MIN(dims.x < 0 ? c.x : c.x + dims.x, (i32)rs->w);
+    i32 const b = MIN(dims.y < 0 ? c.y : c.y + dims.y, (i32)rs->h);
+    for (i32 y = t; y < b; ++y) {
+        raster_fill_span(rs, l, y, MAX(r - l, 0), col);
     }
 }
 
-void canvas_rect(struct Ctx* ctx, Pair c, Pair dims, argb col, u32 w) {
+void canvas_rect(struct Raster* rs, Pair c, Pair dims, argb col, u32 w) {
     // draw 4 sides and fill 2 corners (edge case on negative-negative input)
     Pair const cap = (Pair) {dims.x < 0 ? (i32)w : 0, dims.y < 0 ? (i32)w : 0};
     Pair const c1 = (Pair) {c.x - cap.x, c.y - cap.y};
     Pair const c2 = (Pair) {c.x + dims.x + cap.x, c.y + dims.y + cap.y};
-    canvas_fill_rect(ctx, c1, (Pair) {dims.x + cap.x, (i32)w}, col);
-    canvas_fill_rect(ctx, c1, (Pair) {(i32)w, dims.y + cap.y}, col);
-    canvas_fill_rect(ctx, c2, (Pair) {-dims.x - cap.x, -(i32)w}, col);
-    canvas_fill_rect(ctx, c2, (Pair) {-(i32)w, -dims.y - cap.y}, col);
+    canvas_fill_rect(rs, c1, (Pair) {dims.x + cap.x, (i32)w}, col);
+    canvas_fill_rect(rs, c1, (Pair) {(i32)w, dims.y + cap.y}, col);
+    canvas_fill_rect(rs, c2, (Pair) {-dims.x - cap.x, -(i32)w}, col);
+    canvas_fill_rect(rs, c2, (Pair) {-(i32)w, -dims.y - cap.y}, col);
     if (dims.x < 0 && dims.y < 0) {
-        canvas_fill_rect(ctx, c1, (Pair) {(i32)w, (i32)w}, col);
-        canvas_fill_rect(ctx, c2, (Pair) {-(i32)w, -(i32)w}, col);
+        canvas_fill_rect(rs, c1, (Pair) {(i32)w, (i32)w}, col);
+        canvas_fill_rect(rs, c2, (Pair) {-(i32)w, -(i32)w}, col);
     }
 }
 
-void canvas_fill_triangle(struct Ctx* ctx, Pair c, Pair dims, argb col) {
-    struct DrawCtx* dc = &ctx->dc;
-    for (i32 i = 0; i < abs(dims.x); ++i) {
-        i32 const line_w = (i32)(abs(dims.y) * ((double)i / abs(dims.x)));
-        for (i32 j = 0; j < line_w; ++j) {
-            // FIXME fix shape
-            ximage_put_checked(
-                dc->cv.im,
-                c.x + (dims.x > 0 ? i : -i),
-                c.y + (dims.y > 0 ? j : -j),
-                col
-            );
-        }
-    }
-}
-
-void canvas_triangle(struct Ctx* ctx, Pair c, Pair dims, argb col, u32 w) {
-    Pair const edges[3] = {
+// vertices of triangle figure in SUBPX units, at pixel centers
+static void canvas_triangle_vertices(Pair c, Pair dims, Pair out[3]) {
+    Pair const v[3] = {
         {c.x + dims.x / 2, c.y},
         {c.x, c.y + dims.y},
         {c.x + dims.x, c.y + dims.y},
     };
-    canvas_line(ctx, edges[0], edges[1], &canvas_draw_fn_pencil);
-    canvas_line(ctx, edges[1], edges[2], &canvas_draw_fn_pencil);
-    canvas_line(ctx, edges[0], edges[2], &canvas_draw_fn_pencil);
+    for (i32 i = 0; i < 3; ++i) {
+        out[i] = (Pair) {
+            v[i].x * SUBPX + SUBPX / 2,
+            v[i].y * SUBPX + SUBPX / 2,
+        };
+    }
 }
 
-void canvas_line(struct Ctx* ctx, Pair from, Pair to, draw_fn draw) {
-    struct DrawCtx* dc = &ctx->dc;
-    assert(dc->cv.im);
+void canvas_fill_triangle(struct Raster* rs, Pair c, Pair dims, argb col) {
+    Pair v[3];
+    canvas_triangle_vertices(c, dims, v);
+    raster_fill_triangle(rs, v, col);
+}
 
-    i32 dx = abs(to.x - from.x);
-    i32 sx = from.x < to.x ? 1 : -1;
-    i32 dy = -abs(to.y - from.y);
-    i32 sy = from.y < to.y ? 1 : -1;
-    i32 error = dx + dy;
+void canvas_triangle(struct Raster* rs, Pair c, Pair dims, argb col, u32 w) {
+    Pair v[3];
+    canvas_triangle_vertices(c, dims, v);
+    canvas_thick_segment(rs, v[0], v[1], col, w);
+    canvas_thick_segment(rs, v[1], v[2], col, w);
+    canvas_thick_segment(rs, v[0], v[2], col, w);
+}
 
-    // FIXME don't work if start point out of canvas
-    while (from.x >= 0 && from.y >= 0 && from.x < dc->cv.im->width
-           && from.y < dc->cv.im->height) {
-        draw(ctx, from);
-        if (from.x == to.x && from.y == to.y) {
-            break;
+// segment in SUBPX units as w wide rectangle with square caps,
+// filled as two triangles
+void canvas_thick_segment(
+    struct Raster* rs,
+    Pair from,
+    Pair to,
+    argb col,
+    u32 w
+) {
+    if (w == 0) {
+        return;
+    }
+    double const len = hypot(to.x - from.x, to.y - from.y);
+    double const half = w * SUBPX / 2.0;
+    // half width along and across segment
+    double const tx = len == 0.0 ? half : (to.x - from.x) / len * half;
+    double const ty = len == 0.0 ? 0.0 : (to.y - from.y) / len * half;
+    Pair const q[4] = {
+        {(i32)lround(from.x - tx - ty), (i32)lround(from.y - ty + tx)},
+        {(i32)lround(to.x + tx - ty), (i32)lround(to.y + ty + tx)},
+        {(i32)lround(to.x + tx + ty), (i32)lround(to.y + ty - tx)},
+        {(i32)lround(from.x - tx + ty), (i32)lround(from.y - ty - tx)},
+    };
+    raster_fill_triangle(rs, (Pair[3]) {q[0], q[1], q[2]}, col);
+    raster_fill_triangle(rs, (Pair[3]) {q[0], q[2], q[3]}, col);
+}
+
+struct Stamp const* stamp_get(
+    struct Ctx* ctx,
+    u32 d,
+    circle_get_alpha_fn get_a
+) {
+    struct Stamp* st = &ctx->stamp;
+    if (st->alpha_dyn && st->d == d && st->get_a == get_a) {
+        return st;
+    }
+    stamp_free(st);
+    st->d = d;
+    st->get_a = get_a;
+    st->alpha_dyn = ecalloc((usize)d * d, sizeof(u8));
+    st->rows_dyn = ecalloc(d, sizeof(struct StampRow));
+
+    double const r = d / 2.0;
+    double const r_sq = r * r;
+    for (i32 dy = 0; dy < d; ++dy) {
+        struct StampRow* row = &st->rows_dyn[dy];
+        row->l = (i32)d;
+        row->r = 0;
+        for (i32 dx = 0; dx < d; ++dx) {
+            double const dr = (dx - r) * (dx - r) + (dy - r) * (dy - r);
+            if (dr > r_sq) {
+                continue;
+            }
+            // circle is convex, so inside pixels form single run
+            row->l = MIN(row->l, dx);
+            row->r = dx + 1;
+            st->alpha_dyn[dy * d + dx] = get_a(ctx, r, (Pair) {dx, dy});
         }
-        i32 e2 = 2 * error;
-        if (e2 >= dy) {
-            if (from.x == to.x) {
-                break;
+    }
+    return st;
+}
+
+void stamp_free(struct Stamp* st) {
+    free(st->alpha_dyn);
+    free(st->rows_dyn);
+    *st = (struct Stamp) {0};
+}
+
+// floor of square root, bit by bit
+static u64 isqrt_u64(u64 v) {
+    u64 root = 0;
+    for (u64 bit = (u64)1 << 62; bit; bit >>= 2) {
+        if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+// half width of ellipse at dy from its center or -1 if row misses it,
+// everything in ELLIPSE_FRAC_BITS fixed point
+static i64 ellipse_hw(i64 rx, i64 ry, i64 dy) {
+    dy = dy < 0 ? -dy : dy;
+    if (rx <= 0 || ry <= 0 || dy > ry) {
+        return -1;
+    }
+    // dy scaled onto circle of radius rx, keeps products within 64 bits
+    i64 const q = (rx * dy + ry / 2) / ry;
+    return (i64)isqrt_u64((u64)(rx * rx - q * q));
+}
+
+// axis-aligned ellipse or its w thick outline with center and radii in
+// SUBPX units, filled as row spans; with antialiasing each pixel row is
+// split into ELLIPSE_AA_SAMPLES subrows whose span edges give exact
+// horizontal coverage, so only edge pixels are blended
+void canvas_ellipse(
+    struct Raster* rs,
+    Pair c,
+    Pair r,
+    argb col,
+    u32 w,
+    Bool fill
+) {
+    i64 const one = (i64)1 << ELLIPSE_FRAC_BITS;
+    u32 const sh = ELLIPSE_FRAC_BITS - SUBPX_BITS;
+    Bool const aa = TOOLS.figure_antialias;
+    u32 const n = aa ? ELLIPSE_AA_SAMPLES : 1;
+    i64 const cx = (i64)c.x * (1 << sh);
+    i64 const cy = (i64)c.y * (1 << sh);
+    i64 const rx = (i64)r.x * (1 << sh);
+    i64 const ry = (i64)r.y * (1 << sh);
+    // inner ellipse cut out of outline, none if fill or w covers all
+    i64 const irx = fill ? 0 : rx - ((i64)w << ELLIPSE_FRAC_BITS);
+    i64 const iry = fill ? 0 : ry - ((i64)w << ELLIPSE_FRAC_BITS);
+    u8* alpha = ecalloc(rs->w, sizeof(u8));
+
+    i32 const y_beg = (i32)MAX(floor_div(cy - ry, one), 0);
+    i32 const y_end = (i32)MIN(floor_div(cy + ry, one) + 1, (i64)rs->h);
+    for (i32 y = y_beg; y < y_end; ++y) {
+        // outer and inner span per subrow, empty ones are zero width
+        // at center; pixels fully in every outer span and touching no
+        // inner one are solid, fully in every inner one are skipped
+        struct {
+            i64 l;
+            i64 r;
+        } o[ELLIPSE_AA_SAMPLES], in[ELLIPSE_AA_SAMPLES];
+        i64 tl = INT64_MAX, tr = INT64_MIN;  // touched by outer
+        i64 sl = INT64_MIN, sr = INT64_MAX;  // solid unless in hole
+        i64 hl = INT64_MAX, hr = INT64_MIN;  // touched by inner
+        i64 el = INT64_MIN, er = INT64_MAX;  // empty hole interior
+        for (u32 k = 0; k < n; ++k) {
+            i64 const dy = ((i64)y << ELLIPSE_FRAC_BITS)
+                         + (2 * k + 1) * one / (2 * n) - cy;
+            i64 const ohw = ellipse_hw(rx, ry, dy);
+            i64 const ihw = ellipse_hw(irx, iry, dy);
+            o[k].l = cx - MAX(ohw, 0);
+            o[k].r = cx + MAX(ohw, 0);
+            in[k].l = cx - MAX(ihw, 0);
+            in[k].r = cx + MAX(ihw, 0);
+            if (!aa) {
+                // pixels with center inside, hole made the same way
+                i64 const half = one / 2;
+                tl = sl = ohw < 0 ? 0 : -floor_div(half - o[k].l, one);
+                tr = sr = ohw < 0 ? 0 : floor_div(o[k].r - half, one) + 1;
+                hl = el = ihw < 0 ? 0 : -floor_div(half - in[k].l, one);
+                hr = er = ihw < 0 ? 0 : floor_div(in[k].r - half, one) + 1;
+                continue;
             }
-            error += dy;
-            from.x += sx;
+            tl = MIN(tl, floor_div(o[k].l, one));
+            tr = MAX(tr, -floor_div(-o[k].r, one));
+            sl = MAX(sl, -floor_div(-o[k].l, one));
+            sr = MIN(sr, floor_div(o[k].r, one));
+            hl = MIN(hl, floor_div(in[k].l, one));
+            hr = MAX(hr, -floor_div(-in[k].r, one));
+            el = MAX(el, -floor_div(-in[k].l, one));
+            er = MIN(er, floor_div(in[k].r, one));
         }
-        if (e2 <= dx) {
-            if (from.y == to.y) {
-                break;
+        if (sl >= sr) {
+            sl = sr = tr;  // no solid pixels, whole row is edge
+        }
+        if (hl >= hr) {
+            hl = hr = sl;
+        }
+        if (el >= er) {
+            el = er = hr;
+        }
+
+        raster_fill_span(rs, (i32)sl, y, (u32)MAX(MIN(sr, hl) - sl, 0), col);
+        i64 const sl2 = MAX(sl, hr);
+        raster_fill_span(rs, (i32)sl2, y, (u32)MAX(sr - sl2, 0), col);
+        if (!aa) {
+            continue;
+        }
+
+        // edge pixels in order, blended with coverage summed over subrows
+        i64 const hole_l = MAX(hl, sl);
+        i64 const hole_r = MIN(hr, sr);
+        struct StampRow const edges[4] = {
+            {(i32)tl, (i32)MIN(sl, tr)},
+            {(i32)hole_l, (i32)MAX(MIN(el, hole_r), hole_l)},
+            {(i32)MAX(MIN(er, hole_r), hole_l), (i32)hole_r},
+            {(i32)MAX(sr, tl), (i32)tr},
+        };
+        for (u32 i = 0; i < LENGTH(edges); ++i) {
+            i32 const l = MAX(edges[i].l, 0);
+            i32 const e_r = MIN(edges[i].r, (i32)rs->w);
+            for (i32 x = l; x < e_r; ++x) {
+                i64 const px_l = (i64)x << ELLIPSE_FRAC_BITS;
+                i64 const px_r = px_l + one;
+                i64 cov = 0;
+                for (u32 k = 0; k < n; ++k) {
+                    cov += MAX(MIN(px_r, o[k].r) - MAX(px_l, o[k].l), 0)
+                         - MAX(MIN(px_r, in[k].r) - MAX(px_l, in[k].l), 0);
+                }
+                alpha[x] = (u8)(cov * 0xFF / (n * one));
+            }
+            for (i32 x = l; x < e_r;) {
+                u32 span_len = 0;
+                argb* span = raster_span_w(rs, x, y, &span_len);
+                span_len = MIN(span_len, (u32)(e_r - x));
+                blend_row(span, &alpha[x], span_len, col);
+                x += (i32)span_len;
             }
-            error += dx;
-            from.y += sy;
         }
     }
+    free(alpha);
 }
 
 void canvas_circle(
@@ -1907,30 +4124,235 @@ void canvas_circle(
     argb col,
     circle_get_alpha_fn get_a
 ) {
-    struct DrawCtx* dc = &ctx->dc;
+    struct Raster* rs = &ctx->dc.cv.rs;
     if (d == 1) {
-        ximage_put_checked(dc->cv.im, c.x, c.y, col);
+        raster_put(rs, c.x, c.y, col);
+        return;
+    }
+    if (d == 0) {
+        return;
+    }
+    struct Stamp const* st = stamp_get(ctx, d, get_a);
+    i32 const l = c.x - (i32)(d / 2);
+    i32 const t = c.y - (i32)(d / 2);
+    for (i32 dy = 0; dy < d; ++dy) {
+        i32 const y = t + dy;
+        if (y < 0 || y >= rs->h) {
+            continue;
+        }
+        i32 x = MAX(l + st->rows_dyn[dy].l, 0);
+        i32 const x_end = MIN(l + st->rows_dyn[dy].r, (i32)rs->w);
+        while (x < x_end) {
+            u32 span_len = 0;
+            argb* span = raster_span_w(rs, x, y, &span_len);
+            span_len = MIN(span_len, (u32)(x_end - x));
+            blend_row(span, &st->alpha_dyn[dy * d + (x - l)], span_len, col);
+            x += (i32)span_len;
+        }
+    }
+}
+
+// same footprint as canvas_draw_fn_pencil at each Bresenham point
+void canvas_stroke_square(
+    struct Raster* rs,
+    Pair from,
+    Pair to,
+    u32 w,
+    argb col
+) {
+    if (w == 0) {
+        return;
+    }
+    i32 const half = (i32)w / 2;
+    i32 const top = MIN(from.y, to.y) - half;
+    u32 const rows_len = abs(to.y - from.y) + w;
+    struct StampRow* rows = ecalloc(rows_len, sizeof(struct StampRow));
+    for (u32 i = 0; i < rows_len; ++i) {
+        rows[i] = (struct StampRow) {INT32_MAX, INT32_MIN};
+    }
+
+    // squares of neighboring points overlap, so each row is single run
+    i32 const dx = abs(to.x - from.x);
+    i32 const sx = from.x < to.x ? 1 : -1;
+    i32 const dy = -abs(to.y - from.y);
+    i32 const sy = from.y < to.y ? 1 : -1;
+    i32 error = dx + dy;
+    Pair p = from;
+    while (True) {
+        for (i32 i = 0; i < (i32)w; ++i) {
+            struct StampRow* row = &rows[p.y - half + i - top];
+            row->l = MIN(row->l, p.x - half);
+            row->r = MAX(row->r, p.x - half + (i32)w);
+        }
+        if (p.x == to.x && p.y == to.y) {
+            break;
+        }
+        i32 const e2 = 2 * error;
+        if (e2 >= dy) {
+            error += dy;
+            p.x += sx;
+        }
+        if (e2 <= dx) {
+            error += dx;
+            p.y += sy;
+        }
+    }
+
+    for (u32 i = 0; i < rows_len; ++i) {
+        if (rows[i].l < rows[i].r) {
+            u32 const len = rows[i].r - rows[i].l;
+            raster_fill_span(rs, rows[i].l, top + (i32)i, len, col);
+        }
+    }
+    free(rows);
+}
+
+// squared distance from point to segment (a, a + v)
+static double segment_dist_sq(
+    double x,
+    double y,
+    double ax,
+    double ay,
+    double vx,
+    double vy
+) {
+    double const len_sq = vx * vx + vy * vy;
+    double t = len_sq == 0.0 ? 0.0 : ((x - ax) * vx + (y - ay) * vy) / len_sq;
+    t = CLAMP(t, 0.0, 1.0);
+    double const ex = x - (ax + t * vx);
+    double const ey = y - (ay + t * vy);
+    return ex * ex + ey * ey;
+}
+
+// brush swept along segment: each pixel gets alpha of its distance to
+// segment, written only if it exceeds coverage already in this stroke
+void canvas_stroke_soft(
+    struct Ctx* ctx,
+    Pair from,
+    Pair to,
+    u32 d,
+    argb col
+) {
+    struct Raster* rs = &ctx->dc.cv.rs;
+    struct Stroke* st = &ctx->stroke;
+    if (d <= 1) {
+        canvas_stroke_square(rs, from, to, d, col);
         return;
     }
+    u8 const* lut = stroke_lut(st, d);
     double const r = d / 2.0;
     double const r_sq = r * r;
-    u32 const l = c.x - (u32)r;
-    u32 const t = c.y - (u32)r;
-    for (i32 dx = 0; dx < d; ++dx) {
-        for (i32 dy = 0; dy < d; ++dy) {
-            double const dr = (dx - r) * (dx - r) + (dy - r) * (dy - r);
-            u32 const x = l + dx;
-            u32 const y = t + dy;
-            if (!BETWEEN(x, 0, dc->cv.im->width - 1)
-                || !BETWEEN(y, 0, dc->cv.im->height - 1) || dr > r_sq) {
+    // same center as canvas_circle stamp
+    double const ax = from.x + (d % 2 ? 0.5 : 0.0);
+    double const ay = from.y + (d % 2 ? 0.5 : 0.0);
+    double const vx = to.x - from.x;
+    double const vy = to.y - from.y;
+
+    i32 const y_beg = MAX((i32)floor(MIN(ay, ay + vy) - r), 0);
+    i32 const y_end = MIN((i32)ceil(MAX(ay, ay + vy) + r) + 1, (i32)rs->h);
+    for (i32 y = y_beg; y < y_end; ++y) {
+        // distance along row is convex with minimum at segment point
+        // nearest to row, so inside pixels form single run around it
+        double const t = vy == 0.0 ? 0.0 : CLAMP((y - ay) / vy, 0.0, 1.0);
+        i32 xl = (i32)floor(ax + t * vx);
+        if (segment_dist_sq(xl, y, ax, ay, vx, vy) > r_sq) {
+            ++xl;
+            if (segment_dist_sq(xl, y, ax, ay, vx, vy) > r_sq) {
                 continue;
             }
-            argb const bg = XGetPixel(dc->cv.im, x, y);
-            argb const blended =
-                blend_background(col, bg, get_a(ctx, r, (Pair) {dx, dy}));
-            XPutPixel(dc->cv.im, x, y, blended);
+        }
+        i32 xr = xl + 1;  // exclusive
+        while (segment_dist_sq(xl - 1, y, ax, ay, vx, vy) <= r_sq) {
+            --xl;
+        }
+        while (segment_dist_sq(xr, y, ax, ay, vx, vy) <= r_sq) {
+            ++xr;
+        }
+
+        i32 x = MAX(xl, 0);
+        i32 const x_end = MIN(xr, (i32)rs->w);
+        while (x < x_end) {
+            u32 span_len = 0;
+            argb* span = raster_span_w(rs, x, y, &span_len);
+            span_len = MIN(span_len, (u32)(x_end - x));
+            struct StrokeTile const* tile = stroke_tile(st, rs, x, y);
+            u32 const i = (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+            for (u32 j = 0; j < span_len; ++j) {
+                double const dist_sq =
+                    segment_dist_sq(x + (i32)j, y, ax, ay, vx, vy);
+                u8 const a = lut[(u32)(dist_sq * STROKE_LUT_SCALE)];
+                if (a > tile->cov_dyn[i + j]) {
+                    tile->cov_dyn[i + j] = a;
+                    span[j] = blend_background(col, tile->orig_dyn[i + j], a);
+                }
+            }
+            x += (i32)span_len;
+        }
+    }
+}
+
+u8 const* stroke_lut(struct Stroke* st, u32 d) {
+    if (st->lut_dyn && st->lut_d == d) {
+        return st->lut_dyn;
+    }
+    free(st->lut_dyn);
+    double const r = d / 2.0;
+    u32 const len = (u32)(r * r * STROKE_LUT_SCALE) + 1;
+    st->lut_d = d;
+    st->lut_dyn = ecalloc(len, sizeof(u8));
+    for (u32 i = 0; i < len; ++i) {
+        st->lut_dyn[i] = brush_alpha(sqrt((double)i / STROKE_LUT_SCALE) / r);
+    }
+    return st->lut_dyn;
+}
+
+// tile of stroke buffers at canvas pixel, captured on first touch
+struct StrokeTile const* stroke_tile(
+    struct Stroke* st,
+    struct Raster const* rs,
+    i32 x,
+    i32 y
+) {
+    if (st->tiles_dyn && (st->tw != rs->tw || st->th != rs->th)) {
+        stroke_end(st);  // canvas resized during stroke
+    }
+    if (!st->tiles_dyn) {
+        st->tw = rs->tw;
+        st->th = rs->th;
+        st->tiles_dyn =
+            ecalloc((usize)st->tw * st->th, sizeof(struct StrokeTile));
+    }
+    u32 const tx = x >> TILE_SIZE_LOG2;
+    u32 const ty = y >> TILE_SIZE_LOG2;
+    struct StrokeTile* tile = &st->tiles_dyn[ty * st->tw + tx];
+    if (!tile->cov_dyn) {
+        tile->cov_dyn = ecalloc(TILE_PX, sizeof(u8));
+        tile->orig_dyn = ecalloc(TILE_PX, sizeof(argb));
+        argb const* px = rs->tiles[ty * rs->tw + tx].px;
+        if (px) {
+            memcpy(tile->orig_dyn, px, TILE_PX * sizeof(argb));
+        } else {
+            pixels_fill(tile->orig_dyn, TILE_PX, rs->empty);
         }
     }
+    return tile;
+}
+
+void stroke_end(struct Stroke* st) {
+    if (st->tiles_dyn) {
+        for (u32 i = 0; i < st->tw * st->th; ++i) {
+            free(st->tiles_dyn[i].cov_dyn);
+            free(st->tiles_dyn[i].orig_dyn);
+        }
+        free(st->tiles_dyn);
+    }
+    st->tiles_dyn = NULL;
+}
+
+void stroke_free(struct Stroke* st) {
+    stroke_end(st);
+    free(st->lut_dyn);
+    *st = (struct Stroke) {0};
 }
 
 void canvas_copy_region(
@@ -1940,61 +4362,212 @@ void canvas_copy_region(
     Pair to,
     Bool clear_source
 ) {
-    struct DrawCtx* dc = &ctx->dc;
-    i32 const w = dc->cv.im->width;
-    i32 const h = dc->cv.im->height;
-
-    u32* region_dyn = (u32*)ecalloc(w * h, sizeof(u32));
-    for (i32 get_or_set = 1; get_or_set >= 0; --get_or_set) {
-        for (i32 y = 0; y < dims.y; ++y) {
-            for (i32 x = 0; x < dims.x; ++x) {
-                if (get_or_set) {
-                    region_dyn[y * w + x] =
-                        XGetPixel(dc->cv.im, from.x + x, from.y + y);
-                    if (clear_source) {
-                        ximage_put_checked(
-                            dc->cv.im,
-                            from.x + x,
-                            from.y + y,
-                            CANVAS.background_argb
-                        );
-                    }
-                } else {
-                    ximage_put_checked(
-                        dc->cv.im,
-                        to.x + x,
-                        to.y + y,
-                        region_dyn[y * w + x]
-                    );
-                }
-            }
+    struct Raster* rs = &ctx->dc.cv.rs;
+    // clip source, destination is clipped on write
+    Pair const lt = {MAX(from.x, 0), MAX(from.y, 0)};
+    Pair const rb = {
+        MIN(from.x + dims.x, (i32)rs->w),
+        MIN(from.y + dims.y, (i32)rs->h),
+    };
+    if (lt.x >= rb.x || lt.y >= rb.y) {
+        return;
+    }
+    to.x += lt.x - from.x;
+    to.y += lt.y - from.y;
+    u32 const w = rb.x - lt.x;
+    u32 const h = rb.y - lt.y;
+
+    argb* region_dyn = ecalloc((usize)w * h, sizeof(argb));
+    for (u32 y = 0; y < h; ++y) {
+        raster_read_row(rs, lt.x, lt.y + (i32)y, w, &region_dyn[y * w]);
+    }
+    if (clear_source) {
+        argb const bg = CANVAS.background_argb;
+        for (u32 y = 0; y < h; ++y) {
+            raster_fill_span(rs, lt.x, lt.y + (i32)y, w, bg);
         }
     }
+    for (u32 y = 0; y < h; ++y) {
+        raster_write_row(rs, to.x, to.y + (i32)y, w, &region_dyn[y * w]);
+    }
     free(region_dyn);
 }
 
 void canvas_fill(struct Ctx* ctx, argb col) {
     struct DrawCtx* dc = &ctx->dc;
-    assert(dc && dc->cv.im);
+    assert(dc && dc->cv.rs.tiles);
+
+    raster_fill(&dc->cv.rs, col);
+}
 
-    for (i32 i = 0; i < dc->cv.im->width; ++i) {
-        for (i32 j = 0; j < dc->cv.im->height; ++j) {
-            XPutPixel(dc->cv.im, i, j, col);
+static void canvas_load(struct DrawCtx* dc, XImage* im, char const* file_path) {
+    assert(im);
+    struct History* rec = dc->cv.rs.rec;
+    if (rec) {
+        history_record_all(rec, &dc->cv.rs);
+    }
+    canvas_free(&dc->cv);
+    raster_from_ximage(&dc->cv.rs, im);
+    dc->cv.rs.rec = rec;
+    XDestroyImage(im);
+    dc->cv.type = file_type(file_path);
+}
+
+void canvas_free(struct Canvas* cv) {
+    raster_free(&cv->rs);
+    overlay_free(cv);
+    for (u32 i = 0; i < MIP_LEVELS - 1; ++i) {
+        raster_free(&cv->mips[i].rs);
+        free(cv->mips[i].src_gens);
+        cv->mips[i].src_gens = NULL;
+    }
+}
+
+// drops previous preview, overlay is created on first use
+void overlay_clear(struct Canvas* cv) {
+    struct Raster* ov = &cv->overlay;
+    if (ov->tiles && (ov->w != cv->rs.w || ov->h != cv->rs.h)) {
+        overlay_free(cv);
+    }
+    if (!ov->tiles) {
+        raster_init(ov, cv->rs.w, cv->rs.h, 0x00000000);
+        ov->base = &cv->rs;
+        return;
+    }
+    for (u32 i = 0; i < ov->tw * ov->th; ++i) {
+        struct Tile* t = &ov->tiles[i];
+        if (t->px) {
+            tile_px_unref(t->px);
+            t->px = NULL;
+            t->dirty = True;  // transparent again on screen
         }
     }
-}
+}
+
+void overlay_free(struct Canvas* cv) {
+    raster_free(&cv->overlay);
+}
+
+struct Raster* canvas_level(struct Canvas* cv, u32 level) {
+    assert(level < MIP_LEVELS);
+    return level == 0 ? &cv->rs : &cv->mips[level - 1].rs;
+}
+
+// level to downscale from, by no more than 2 times
+u32 canvas_mip_level(struct DrawCtx const* dc) {
+    double const zoom = ZOOM_C(dc);
+    u32 level = 0;
+    while (level + 1 < MIP_LEVELS && zoom * (1 << (level + 1)) <= 1.0) {
+        level += 1;
+    }
+    return level;
+}
+
+// rebuilds tiles of level intersecting r (in level pixels) which sources
+// changed since last build
+void canvas_mip_update(struct Canvas* cv, u32 level, Rect r) {
+    assert(level != 0);
+    if (level > 1) {
+        canvas_mip_update(
+            cv,
+            level - 1,
+            (Rect) {
+                .lt = {r.lt.x * 2, r.lt.y * 2},
+                .rb = {r.rb.x * 2, r.rb.y * 2},
+            }
+        );
+    }
+    struct Raster const* src = canvas_level(cv, level - 1);
+    struct Mip* mip = &cv->mips[level - 1];
+    u32 const w = MAX(1, (src->w + 1) / 2);
+    u32 const h = MAX(1, (src->h + 1) / 2);
+    if (mip->rs.tiles == NULL || mip->rs.w != w || mip->rs.h != h) {
+        raster_free(&mip->rs);
+        raster_init(&mip->rs, w, h, src->empty);
+        free(mip->src_gens);
+        mip->src_gens = ecalloc(mip->rs.tw * mip->rs.th, sizeof(u32[4]));
+    }
+    mip->rs.empty = src->empty;
+    r.lt.x = MAX(r.lt.x, 0);
+    r.lt.y = MAX(r.lt.y, 0);
+    r.rb.x = MIN(r.rb.x, (i32)w);
+    r.rb.y = MIN(r.rb.y, (i32)h);
+    if (r.lt.x >= r.rb.x || r.lt.y >= r.rb.y) {
+        return;
+    }
 
-static void canvas_load(struct DrawCtx* dc, XImage* im, char const* file_path) {
-    assert(im);
-    canvas_free(dc->dp, &dc->cv);
-    dc->cv.im = im;
-    dc->cv.type = file_type(file_path);
-}
+    u32 const tx1 = ((u32)r.rb.x + TILE_MASK) >> TILE_SIZE_LOG2;
+    u32 const ty1 = ((u32)r.rb.y + TILE_MASK) >> TILE_SIZE_LOG2;
+    for (u32 ty = (u32)r.lt.y >> TILE_SIZE_LOG2; ty < ty1; ++ty) {
+        for (u32 tx = (u32)r.lt.x >> TILE_SIZE_LOG2; tx < tx1; ++tx) {
+            // 2x2 source tiles, gen 0 is never used for existing ones
+            struct Tile const* st[4] = {0};
+            u32 gens[4] = {0};
+            Bool all_empty = True;
+            for (u32 q = 0; q < 4; ++q) {
+                u32 const stx = tx * 2 + (q & 1);
+                u32 const sty = ty * 2 + (q >> 1);
+                if (stx < src->tw && sty < src->th) {
+                    st[q] = &src->tiles[sty * src->tw + stx];
+                    gens[q] = st[q]->gen;
+                    all_empty &= st[q]->px == NULL;
+                }
+            }
+            u32 const ti = ty * mip->rs.tw + tx;
+            struct Tile* t = &mip->rs.tiles[ti];
+            if (memcmp(mip->src_gens[ti], gens, sizeof(gens)) == 0) {
+                continue;
+            }
+            memcpy(mip->src_gens[ti], gens, sizeof(gens));
 
-void canvas_free(Display* dp, struct Canvas* cv) {
-    if (cv->im) {
-        XDestroyImage(cv->im);
-        cv->im = NULL;
+            if (all_empty) {
+                tile_px_unref(t->px);
+                t->px = NULL;
+                t->gen = ++last_tile_gen;
+                t->dirty = True;
+                continue;
+            }
+            argb* px = raster_tile_w(&mip->rs, tx, ty);
+            for (u32 q = 0; q < 4; ++q) {
+                if (st[q] == NULL) {
+                    continue;
+                }
+                // source tile shrinks to quadrant q of destination
+                u32 const half = TILE_SIZE / 2;
+                i32 const sx0 = (i32)((tx * 2 + (q & 1)) << TILE_SIZE_LOG2);
+                i32 const sy0 = (i32)((ty * 2 + (q >> 1)) << TILE_SIZE_LOG2);
+                u32 const sw = MIN(TILE_SIZE, src->w - sx0);
+                u32 const sh = MIN(TILE_SIZE, src->h - sy0);
+                argb* dst = px + (q >> 1) * half * TILE_SIZE + (q & 1) * half;
+                for (u32 y = 0; y * 2 < sh; ++y) {
+                    u32 const y0 = y * 2;
+                    u32 const y1 = MIN(y0 + 1, sh - 1);
+                    for (u32 x = 0; x * 2 < sw; ++x) {
+                        u32 const x0 = x * 2;
+                        u32 const x1 = MIN(x0 + 1, sw - 1);
+                        argb const s[4] = {
+                            st[q]->px ? st[q]->px[y0 * TILE_SIZE + x0]
+                                      : src->empty,
+                            st[q]->px ? st[q]->px[y0 * TILE_SIZE + x1]
+                                      : src->empty,
+                            st[q]->px ? st[q]->px[y1 * TILE_SIZE + x0]
+                                      : src->empty,
+                            st[q]->px ? st[q]->px[y1 * TILE_SIZE + x1]
+                                      : src->empty,
+                        };
+                        argb result = 0;
+                        for (u32 ch = 0; ch < 32; ch += 8) {
+                            u32 const sum = ((s[0] >> ch) & 0xFF)
+                                + ((s[1] >> ch) & 0xFF)
+                                + ((s[2] >> ch) & 0xFF)
+                                + ((s[3] >> ch) & 0xFF);
+                            result |= ((sum + 2) >> 2) << ch;
+                        }
+                        dst[y * TILE_SIZE + x] = result;
+                    }
+                }
+            }
+        }
     }
 }
 
@@ -2014,18 +4587,16 @@ void canvas_resize(struct Ctx* ctx, i32 new_width, i32 new_height) {
         return;
     }
     struct DrawCtx* dc = &ctx->dc;
-    u32 const old_width = dc->cv.im->width;
-    u32 const old_height = dc->cv.im->height;
+    u32 const old_width = dc->cv.rs.w;
+    u32 const old_height = dc->cv.rs.h;
 
     // FIXME can fill color be changed?
-    XImage* new_cv_im = XSubImage(dc->cv.im, 0, 0, new_width, new_height);
-    XDestroyImage(dc->cv.im);
-    dc->cv.im = new_cv_im;
+    raster_resize(&dc->cv.rs, new_width, new_height);
 
     // fill new area if needed
     if (old_width < new_width) {
         canvas_fill_rect(
-            ctx,
+            &dc->cv.rs,
             (Pair) {(i32)old_width, 0},
             (Pair) {(i32)(new_width - old_width), new_height},
             CANVAS.background_argb
@@ -2033,7 +4604,7 @@ void canvas_resize(struct Ctx* ctx, i32 new_width, i32 new_height) {
     }
     if (old_height < new_height) {
         canvas_fill_rect(
-            ctx,
+            &dc->cv.rs,
             (Pair) {0, (i32)old_height},
             (Pair) {new_width, (i32)(new_height - old_height)},
             CANVAS.background_argb
@@ -2052,10 +4623,8 @@ void draw_string(
     enum Schm sc,
     Bool invert
 ) {
-    XftDraw* d =
-        XftDrawCreate(dc->dp, dc->back_buffer, dc->vinfo.visual, dc->colmap);
     XftDrawStringUtf8(
-        d,
+        dc->target.xft,
         invert ? &dc->schemes_dyn[sc].bg : &dc->schemes_dyn[sc].fg,
         dc->fnt.xfont,
         c.x,
@@ -2063,7 +4632,6 @@ void draw_string(
         (XftChar8*)str,
         (i32)strlen(str)
     );
-    XftDrawDestroy(d);
 }
 
 void draw_int(struct DrawCtx* dc, i32 i, Pair c, enum Schm sc, Bool invert) {
@@ -2077,7 +4645,7 @@ int fill_rect(struct DrawCtx* dc, Pair p, Pair dim, argb col) {
     XSetForeground(dc->dp, dc->screen_gc, col | 0xFF000000);
     return XFillRectangle(
         dc->dp,
-        dc->back_buffer,
+        dc->target.d,
         dc->screen_gc,
         p.x,
         p.y,
@@ -2100,7 +4668,7 @@ int draw_rect(
     XSetLineAttributes(dc->dp, dc->screen_gc, line_w, line_st, cap_st, join_st);
     return XDrawRectangle(
         dc->dp,
-        dc->back_buffer,
+        dc->target.d,
         dc->screen_gc,
         p.x,
         p.y,
@@ -2123,7 +4691,7 @@ int draw_line(
     );
     return XDrawLine(
         dc->dp,
-        dc->back_buffer,
+        dc->target.d,
         dc->screen_gc,
         from.x,
         from.y,
@@ -2132,31 +4700,43 @@ int draw_line(
     );
 }
 
-u32 get_string_width(struct DrawCtx const* dc, char const* str, u32 len) {
+u32 get_string_width(struct DrawCtx* dc, char const* str, u32 len) {
+    // statusline asks same short strings each frame
+    char key[64];
+    Bool const cacheable = len < sizeof(key);
+    if (cacheable) {
+        memcpy(key, str, len);
+        key[len] = '\0';
+        ptrdiff_t const i = shgeti(dc->fnt.widths_hm, key);
+        if (i != NIL) {
+            return dc->fnt.widths_hm[i].value;
+        }
+    }
     XGlyphInfo ext;
     XftTextExtentsUtf8(dc->dp, dc->fnt.xfont, (XftChar8*)str, (i32)len, &ext);
+    if (cacheable) {
+        shput(dc->fnt.widths_hm, key, ext.xOff);
+    }
     return ext.xOff;
 }
 
-u32 get_int_width(struct DrawCtx const* dc, char const* format, u32 i) {
+u32 get_int_width(struct DrawCtx* dc, char const* format, u32 i) {
     static u32 const MAX_BUF = 50;
     char buf[MAX_BUF];
     snprintf(buf, MAX_BUF, format, i);
     return get_string_width(dc, buf, strlen(buf));
 }
 
-void draw_selection_circle(
+// draws circle centered in (sc->r, sc->r) of d
+void sel_circ_paint(
     struct DrawCtx* dc,
     struct SelectionCircle const* sc,
-    i32 const pointer_x,
-    i32 const pointer_y
+    Drawable d,
+    Bool focused
 ) {
-    if (!sc->is_active) {
-        return;
-    }
-
     i32 const outer_r = (i32)SELECTION_CIRCLE.outer_r_px;
     i32 const inner_r = (i32)SELECTION_CIRCLE.inner_r_px;
+    i32 const c = (i32)sc->r;
 
     XSetLineAttributes(
         dc->dp,
@@ -2168,12 +4748,18 @@ void draw_selection_circle(
     );
 
     XSetForeground(dc->dp, dc->screen_gc, COL_BG(dc, SchmNorm));
+    XFillRectangle(dc->dp, d, dc->screen_gc, 0, 0, c * 2, c * 2);
+    XSetForeground(
+        dc->dp,
+        dc->screen_gc,
+        focused ? COL_BG(dc, SchmFocus) : COL_BG(dc, SchmNorm)
+    );
     XFillArc(
         dc->dp,
-        dc->window,
+        d,
         dc->screen_gc,
-        sc->x - outer_r,
-        sc->y - outer_r,
+        c - outer_r,
+        c - outer_r,
         outer_r * 2,
         outer_r * 2,
         0,
@@ -2182,60 +4768,46 @@ void draw_selection_circle(
 
     {
         double const segment_rad = PI * 2 / MAX(1, sc->item_count);
-        double const segment_deg = segment_rad / PI * 180;
-
-        // item images
-        for (u32 item = 0; item < sc->item_count; ++item) {
-            XImage* image = images[sc->items[item].icon];
-            assert(image != NULL);
 
-            XPutImage(
-                dc->dp,
-                dc->window,
-                dc->screen_gc,
-                image,
-                0,
-                0,
-                (i32)(sc->x
-                      + cos(-segment_rad * (item + 0.5))
-                          * ((outer_r + inner_r) * 0.5)
-                      - image->width / 2.0),
-                (i32)(sc->y
-                      + sin(-segment_rad * (item + 0.5))
-                          * ((outer_r + inner_r) * 0.5)
-                      - image->height / 2.0),
-                image->width,
-                image->height
-            );
-        }
-
-        // selected item fill
-        i32 const current_item = sel_circ_curr_item(sc, pointer_x, pointer_y);
-        if (current_item != NIL) {
-            XSetForeground(dc->dp, dc->screen_gc, COL_BG(dc, SchmFocus));
-            XFillArc(
-                dc->dp,
-                dc->window,
-                dc->screen_gc,
-                sc->x - outer_r,
-                sc->y - outer_r,
-                outer_r * 2,
-                outer_r * 2,
-                (i32)(current_item * segment_deg) * 64,
-                (i32)segment_deg * 64
-            );
+        if (focused) {
+            // highlighted segment covers its icon
             XSetForeground(dc->dp, dc->screen_gc, COL_BG(dc, SchmNorm));
             XFillArc(
                 dc->dp,
-                dc->window,
+                d,
                 dc->screen_gc,
-                sc->x - inner_r,
-                sc->y - inner_r,
+                c - inner_r,
+                c - inner_r,
                 inner_r * 2,
                 inner_r * 2,
-                (i32)(current_item * segment_deg) * 64,
-                (i32)segment_deg * 64
+                0,
+                360 * 64
             );
+        } else {
+            // item images
+            for (u32 item = 0; item < sc->item_count; ++item) {
+                XImage* image = images[sc->items[item].icon];
+                assert(image != NULL);
+
+                XPutImage(
+                    dc->dp,
+                    d,
+                    dc->screen_gc,
+                    image,
+                    0,
+                    0,
+                    (i32)(c
+                          + cos(-segment_rad * (item + 0.5))
+                              * ((outer_r + inner_r) * 0.5)
+                          - image->width / 2.0),
+                    (i32)(c
+                          + sin(-segment_rad * (item + 0.5))
+                              * ((outer_r + inner_r) * 0.5)
+                          - image->height / 2.0),
+                    image->width,
+                    image->height
+                );
+            }
         }
 
         if (sc->item_count >= 2) {  // segment lines
@@ -2243,12 +4815,12 @@ void draw_selection_circle(
             for (u32 line_num = 0; line_num < sc->item_count; ++line_num) {
                 XDrawLine(
                     dc->dp,
-                    dc->window,
+                    d,
                     dc->screen_gc,
-                    sc->x + (i32)(cos(segment_rad * line_num) * inner_r),
-                    sc->y + (i32)(sin(segment_rad * line_num) * inner_r),
-                    sc->x + (i32)(cos(segment_rad * line_num) * outer_r),
-                    sc->y + (i32)(sin(segment_rad * line_num) * outer_r)
+                    c + (i32)(cos(segment_rad * line_num) * inner_r),
+                    c + (i32)(sin(segment_rad * line_num) * inner_r),
+                    c + (i32)(cos(segment_rad * line_num) * outer_r),
+                    c + (i32)(sin(segment_rad * line_num) * outer_r)
                 );
             }
         }
@@ -2258,10 +4830,10 @@ void draw_selection_circle(
         XSetForeground(dc->dp, dc->screen_gc, COL_FG(dc, SchmNorm));
         XDrawArc(
             dc->dp,
-            dc->window,
+            d,
             dc->screen_gc,
-            sc->x - inner_r,
-            sc->y - inner_r,
+            c - inner_r,
+            c - inner_r,
             inner_r * 2,
             inner_r * 2,
             0,
@@ -2270,10 +4842,10 @@ void draw_selection_circle(
 
         XDrawArc(
             dc->dp,
-            dc->window,
+            d,
             dc->screen_gc,
-            sc->x - outer_r,
-            sc->y - outer_r,
+            c - outer_r,
+            c - outer_r,
             outer_r * 2,
             outer_r * 2,
             0,
@@ -2282,6 +4854,261 @@ void draw_selection_circle(
     }
 }
 
+// copies prerendered circle to window if highlighted item changed
+void draw_selection_circle(
+    struct DrawCtx* dc,
+    struct SelectionCircle* sc,
+    i32 const pointer_x,
+    i32 const pointer_y
+) {
+    if (!sc->is_active) {
+        return;
+    }
+
+    i32 const current_item = sel_circ_curr_item(sc, pointer_x, pointer_y);
+    if (sc->is_shown && sc->shown_item == current_item) {
+        return;
+    }
+
+    i32 const x = sc->x - (i32)sc->r;
+    i32 const y = sc->y - (i32)sc->r;
+    u32 const side = sc->r * 2;
+    XSetClipOrigin(dc->dp, dc->screen_gc, x, y);
+    XSetClipMask(dc->dp, dc->screen_gc, sc->mask);
+    // clang-format off
+    XCopyArea(
+        dc->dp, sc->base_pm, dc->window, dc->screen_gc,
+        0, 0, side, side, x, y
+    );
+    if (current_item != NIL) {
+        XSetClipMask(dc->dp, dc->screen_gc, sc->item_masks_dyn[current_item]);
+        XCopyArea(
+            dc->dp, sc->focus_pm, dc->window, dc->screen_gc,
+            0, 0, side, side, x, y
+        );
+    }
+    // clang-format on
+    XSetClipMask(dc->dp, dc->screen_gc, None);
+
+    sc->is_shown = True;
+    sc->shown_item = current_item;
+}
+
+static i32 shm_error_hdlr(Display* dp, XErrorEvent* e) {
+    shm_attach_failed = True;
+    return 0;
+}
+
+XImage* shm_image_new(
+    struct DrawCtx const* dc,
+    XShmSegmentInfo* seg,
+    u32 w,
+    u32 h
+) {
+    XImage* im = XShmCreateImage(
+        dc->dp,
+        dc->vinfo.visual,
+        dc->vinfo.depth,
+        ZPixmap,
+        NULL,
+        seg,
+        w,
+        h
+    );
+    if (!im) {
+        return NULL;
+    }
+    seg->shmid =
+        shmget(IPC_PRIVATE, (usize)im->bytes_per_line * h, IPC_CREAT | 0600);
+    if (seg->shmid < 0) {
+        XDestroyImage(im);  // shm images don't own data
+        return NULL;
+    }
+    seg->shmaddr = im->data = shmat(seg->shmid, NULL, 0);
+    seg->readOnly = False;
+    if (seg->shmaddr == (char*)-1) {
+        shmctl(seg->shmid, IPC_RMID, NULL);
+        XDestroyImage(im);
+        return NULL;
+    }
+
+    // attach fails asynchronously on remote displays
+    shm_attach_failed = False;
+    XErrorHandler const prev_hdlr = XSetErrorHandler(&shm_error_hdlr);
+    Bool const attached = XShmAttach(dc->dp, seg);
+    XSync(dc->dp, False);
+    XSetErrorHandler(prev_hdlr);
+    // segment will be destroyed after last detach
+    shmctl(seg->shmid, IPC_RMID, NULL);
+
+    if (!attached || shm_attach_failed) {
+        shmdt(seg->shmaddr);
+        XDestroyImage(im);
+        return NULL;
+    }
+    return im;
+}
+
+void shm_image_free(Display* dp, XImage* im, XShmSegmentInfo* seg) {
+    XShmDetach(dp, seg);
+    XDestroyImage(im);
+    shmdt(seg->shmaddr);
+}
+
+Rect canvas_visible_rect(struct DrawCtx const* dc) {
+    double const z = ZOOM_C(dc);
+    Pair const scroll = dc->cv.scroll;
+    i32 const lx = (i32)floor(-scroll.x / z) - VIEWPORT_MARGIN;
+    i32 const ly = (i32)floor(-scroll.y / z) - VIEWPORT_MARGIN;
+    i32 const rx = (i32)ceil((dc->width - scroll.x) / z) + VIEWPORT_MARGIN;
+    i32 const ry = (i32)ceil((dc->height - scroll.y) / z) + VIEWPORT_MARGIN;
+    return (Rect) {
+        .lt = {CLAMP(lx, 0, (i32)dc->cv.rs.w), CLAMP(ly, 0, (i32)dc->cv.rs.h)},
+        .rb = {CLAMP(rx, 0, (i32)dc->cv.rs.w), CLAMP(ry, 0, (i32)dc->cv.rs.h)},
+    };
+}
+
+// tiles outside of vis stay dirty until scrolled into view
+void cache_upload(struct DrawCtx* dc, struct Raster* rs, Pixmap pm, Rect vis) {
+    if (vis.lt.x >= vis.rb.x || vis.lt.y >= vis.rb.y) {
+        return;
+    }
+    // destinations of tiles copied to shm staging image
+    struct {
+        i32 x, y;
+        u32 w, h;
+    } staged[SHM_STAGING_TILES];
+    u32 staged_len = 0;
+
+    u32 const tx0 = (u32)vis.lt.x >> TILE_SIZE_LOG2;
+    u32 const ty0 = (u32)vis.lt.y >> TILE_SIZE_LOG2;
+    u32 const tx1 = ((u32)vis.rb.x + TILE_MASK) >> TILE_SIZE_LOG2;
+    u32 const ty1 = ((u32)vis.rb.y + TILE_MASK) >> TILE_SIZE_LOG2;
+    for (u32 ty = ty0; ty < ty1; ++ty) {
+        for (u32 tx = tx0; tx < tx1; ++tx) {
+            struct Tile* t = &rs->tiles[ty * rs->tw + tx];
+            if (!t->dirty) {
+                continue;
+            }
+            i32 const x = (i32)(tx << TILE_SIZE_LOG2);
+            i32 const y = (i32)(ty << TILE_SIZE_LOG2);
+            u32 const w = MIN(TILE_SIZE, rs->w - x);
+            u32 const h = MIN(TILE_SIZE, rs->h - y);
+            if (!t->px) {
+                XSetForeground(dc->dp, dc->screen_gc, rs->empty);
+                XFillRectangle(dc->dp, pm, dc->screen_gc, x, y, w, h);
+            } else if (dc->shm.enabled && !dc->shm.put_pending
+                       && staged_len < SHM_STAGING_TILES) {
+                XImage* st = dc->shm.staging;
+                memcpy(
+                    st->data + (usize)staged_len * TILE_PX * sizeof(argb),
+                    t->px,
+                    TILE_PX * sizeof(argb)
+                );
+                staged[staged_len].x = x;
+                staged[staged_len].y = y;
+                staged[staged_len].w = w;
+                staged[staged_len].h = h;
+                staged_len += 1;
+            } else {
+                // staging memory is full or busy until ShmCompletion,
+                // tile is copied into request so frame is never partial
+                dc->cache.tile_im->data = (char*)t->px;
+                XPutImage(
+                    dc->dp,
+                    pm,
+                    dc->screen_gc,
+                    dc->cache.tile_im,
+                    0,
+                    0,
+                    x,
+                    y,
+                    w,
+                    h
+                );
+                dc->cache.tile_im->data = NULL;
+            }
+            t->dirty = False;
+        }
+    }
+
+    for (u32 i = 0; i < staged_len; ++i) {
+        // clang-format off
+        XShmPutImage(
+            dc->dp,
+            pm,
+            dc->screen_gc,
+            dc->shm.staging,
+            0, (i32)(i * TILE_SIZE),
+            staged[i].x, staged[i].y,
+            staged[i].w, staged[i].h,
+            i + 1 == staged_len  // completion on last
+        );
+        // clang-format on
+    }
+    dc->shm.put_pending |= staged_len != 0;
+}
+
+// (re)creates pixmap and picture for raster size, pad is for mip levels
+void cache_level_fit(
+    struct DrawCtx* dc,
+    struct CacheLevel* cl,
+    struct Raster* rs,
+    Bool pad
+) {
+    if (cl->pm != 0 && cl->pm_w == rs->w && cl->pm_h == rs->h) {
+        return;
+    }
+    // new pixmap contents are undefined
+    raster_touch_all(rs);
+    if (cl->src_pict != 0) {
+        XRenderFreePicture(dc->dp, cl->src_pict);
+    }
+    if (cl->pm != 0) {
+        XFreePixmap(dc->dp, cl->pm);
+    }
+    cl->pm =
+        XCreatePixmap(dc->dp, dc->window, rs->w, rs->h, dc->vinfo.depth);
+    cl->pm_w = rs->w;
+    cl->pm_h = rs->h;
+    cl->src_pict = XRenderCreatePicture(
+        dc->dp,
+        cl->pm,
+        dc->xrnd_pic_format,
+        CPSubwindowMode | CPRepeat,
+        &(XRenderPictureAttributes) {
+            .subwindow_mode = IncludeInferiors,
+            .repeat = pad ? RepeatPad : RepeatNone,
+        }
+    );
+    if (pad) {
+        // smooth remaining downscale
+        XRenderSetPictureFilter(dc->dp, cl->src_pict, FilterBilinear, NULL, 0);
+    }
+    cl->pict_zoom_valid = False;  // transform must be set
+}
+
+// sets scale of picture, returns whether it changed
+Bool cache_level_zoom(struct DrawCtx* dc, struct CacheLevel* cl, double z) {
+    if (cl->pict_zoom_valid && cl->pict_zoom == dc->cv.zoom) {
+        return False;
+    }
+    // clang-format off
+    XRenderSetPictureTransform(
+        dc->dp,
+        cl->src_pict,
+        &(XTransform) {{
+            {XDoubleToFixed(z), XDoubleToFixed(0), XDoubleToFixed(0)},
+            {XDoubleToFixed(0), XDoubleToFixed(z), XDoubleToFixed(0)},
+            {XDoubleToFixed(0), XDoubleToFixed(0), XDoubleToFixed(1)},
+        }}
+    );
+    // clang-format on
+    cl->pict_zoom = dc->cv.zoom;
+    cl->pict_zoom_valid = True;
+    return True;
+}
+
 void update_screen(struct Ctx* ctx) {
     struct ToolCtx* tc = &CURR_TC(ctx);
     struct DrawCtx* dc = &ctx->dc;
@@ -2294,73 +5121,88 @@ void update_screen(struct Ctx* ctx) {
         );
         /* put scaled image */ {
             //  https://stackoverflow.com/a/66896097
-            if (dc->cache.pm == 0 || dc->cache.pm_w != dc->cv.im->width
-                || dc->cache.pm_h != dc->cv.im->height) {
-                if (dc->cache.pm != 0) {
-                    XFreePixmap(dc->dp, dc->cache.pm);
-                }
-                dc->cache.pm = XCreatePixmap(
+            u32 const level = canvas_mip_level(dc);
+            struct Raster* rs = canvas_level(&dc->cv, level);
+            struct CacheLevel* cl = &dc->cache.levels[level];
+            Rect vis = canvas_visible_rect(dc);
+            if (level != 0) {
+                i32 const round = (1 << level) - 1;
+                vis.lt.x >>= level;
+                vis.lt.y >>= level;
+                vis.rb.x = (vis.rb.x + round) >> level;
+                vis.rb.y = (vis.rb.y + round) >> level;
+                canvas_mip_update(&dc->cv, level, vis);
+            }
+            cache_level_fit(dc, cl, rs, level != 0);
+            if (dc->cache.dst_pict == 0) {
+                dc->cache.dst_pict = XRenderCreatePicture(
                     dc->dp,
-                    dc->window,
-                    dc->cv.im->width,
-                    dc->cv.im->height,
-                    dc->vinfo.depth
+                    dc->back_buffer,
+                    dc->xrnd_pic_format,
+                    0,
+                    &(XRenderPictureAttributes
+                    ) {.subwindow_mode = IncludeInferiors}
                 );
-                dc->cache.pm_w = dc->cv.im->width;
-                dc->cache.pm_h = dc->cv.im->height;
             }
-            // clang-format off
-            XPutImage(
-                dc->dp,
-                dc->cache.pm,
-                dc->screen_gc,
-                dc->cv.im,
-                0, 0,
-                0, 0,
-                dc->cv.im->width, dc->cv.im->height
-            );
-            // clang-format on
-
-            Picture src_pict = XRenderCreatePicture(
-                dc->dp,
-                dc->cache.pm,
-                dc->xrnd_pic_format,
-                0,
-                &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
-            );
-            Picture dst_pict = XRenderCreatePicture(
-                dc->dp,
-                dc->back_buffer,
-                dc->xrnd_pic_format,
-                0,
-                &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
-            );
-
-            double const z = 1.0 / ZOOM_C(dc);
-            XRenderSetPictureTransform(
-                dc->dp,
-                src_pict,
-                &(XTransform) {{
-                    {XDoubleToFixed(z), XDoubleToFixed(0), XDoubleToFixed(0)},
-                    {XDoubleToFixed(0), XDoubleToFixed(z), XDoubleToFixed(0)},
-                    {XDoubleToFixed(0), XDoubleToFixed(0), XDoubleToFixed(1)},
-                }}
-            );
+            vis.rb.x = MIN(vis.rb.x, (i32)rs->w);
+            vis.rb.y = MIN(vis.rb.y, (i32)rs->h);
+            cache_upload(dc, rs, cl->pm, vis);
+
+            cache_level_zoom(dc, cl, 1.0 / (ZOOM_C(dc) * (1 << level)));
+
+            // figure preview at full resolution, nearest when zoomed in
+            // like level 0 canvas
+            struct Raster* ov = &dc->cv.overlay;
+            struct CacheLevel* ovl = &dc->cache.overlay;
+            if (ov->tiles) {
+                cache_level_fit(dc, ovl, ov, False);
+                cache_upload(dc, ov, ovl->pm, canvas_visible_rect(dc));
+                if (cache_level_zoom(dc, ovl, 1.0 / ZOOM_C(dc))) {
+                    XRenderSetPictureFilter(
+                        dc->dp,
+                        ovl->src_pict,
+                        dc->cv.zoom < 0 ? FilterBilinear : FilterNearest,
+                        NULL,
+                        0
+                    );
+                }
+            }
 
-            // clang-format off
-            XRenderComposite(
-                dc->dp, PictOpSrc,
-                src_pict, 0,
-                dst_pict,
-                0, 0,
-                0, 0,
-                dc->cv.scroll.x, dc->cv.scroll.y,
-                (u32)(dc->cv.im->width * ZOOM_C(dc)), (u32)(dc->cv.im->height * ZOOM_C(dc))
+            // composite only the part of canvas inside the window
+            Pair const scroll = dc->cv.scroll;
+            Pair const dst_lt = {MAX(scroll.x, 0), MAX(scroll.y, 0)};
+            Pair const cv_dims = point_from_cv_to_scr_no_move(
+                dc,
+                (Pair) {(i32)dc->cv.rs.w, (i32)dc->cv.rs.h}
             );
-            // clang-format on
-
-            XRenderFreePicture(dc->dp, src_pict);
-            XRenderFreePicture(dc->dp, dst_pict);
+            Pair const dst_rb = {
+                MIN(scroll.x + cv_dims.x, (i32)dc->width),
+                MIN(scroll.y + cv_dims.y, (i32)dc->height),
+            };
+            if (dst_lt.x < dst_rb.x && dst_lt.y < dst_rb.y) {
+                // clang-format off
+                XRenderComposite(
+                    dc->dp, PictOpSrc,
+                    cl->src_pict, 0,
+                    dc->cache.dst_pict,
+                    dst_lt.x - scroll.x, dst_lt.y - scroll.y,
+                    0, 0,
+                    dst_lt.x, dst_lt.y,
+                    dst_rb.x - dst_lt.x, dst_rb.y - dst_lt.y
+                );
+                if (ov->tiles) {
+                    XRenderComposite(
+                        dc->dp, PictOpOver,
+                        ovl->src_pict, 0,
+                        dc->cache.dst_pict,
+                        dst_lt.x - scroll.x, dst_lt.y - scroll.y,
+                        0, 0,
+                        dst_lt.x, dst_lt.y,
+                        dst_rb.x - dst_lt.x, dst_rb.y - dst_lt.y
+                    );
+                }
+                // clang-format on
+            }
         }
     }
     /* current selection */ {
@@ -2414,13 +5256,14 @@ void update_screen(struct Ctx* ctx) {
     update_statusline(ctx);  // backbuffer swaped here
 }
 
-void update_statusline(struct Ctx* ctx) {
+// draws statusline at top of dc->target
+void statusline_render(struct Ctx* ctx) {
     struct DrawCtx* dc = &ctx->dc;
     struct ToolCtx* tc = &CURR_TC(ctx);
     u32 const statusline_h = get_statusline_height(dc);
     fill_rect(
         dc,
-        (Pair) {0, (i32)(dc->height - statusline_h)},
+        (Pair) {0, 0},
         (Pair) {(i32)dc->width, (i32)statusline_h},
         COL_BG(&ctx->dc, SchmNorm)
     );
@@ -2434,7 +5277,7 @@ void update_statusline(struct Ctx* ctx) {
         memcpy(cl_str_dyn + 1, command, command_len);
         i32 const user_cmd_w =
             (i32)get_string_width(&ctx->dc, cl_str_dyn, command_len + 1);
-        i32 const cmd_y = (i32)(ctx->dc.height - STATUSLINE.padding_bottom);
+        i32 const cmd_y = (i32)(statusline_h - STATUSLINE.padding_bottom);
         draw_string(&ctx->dc, cl_str_dyn, (Pair) {0, cmd_y}, SchmNorm, False);
         if (ctx->input.d.cl.compls_arr) {
             draw_string(
@@ -2465,7 +5308,7 @@ void update_statusline(struct Ctx* ctx) {
         u32 const input_state_w = get_string_width(dc, "FFF", 3) + gap;
         u32 const tool_name_w = get_string_width(dc, "FFFFFFF", 7) + gap;
         // left **bottom** corners of captions
-        Pair const tcs_c = {0, (i32)(dc->height - STATUSLINE.padding_bottom)};
+        Pair const tcs_c = {0, (i32)(statusline_h - STATUSLINE.padding_bottom)};
         Pair const input_state_c = {(i32)(tcs_c.x + tcs_w), tcs_c.y};
         Pair const tool_name_c = {
             (i32)(input_state_c.x + input_state_w),
@@ -2546,12 +5389,88 @@ void update_statusline(struct Ctx* ctx) {
                 dc,
                 (Pair
                 ) {(i32)(dc->width - col_name_w - col_rect_w - col_count_w),
-                   (i32)(dc->height - statusline_h)},
+                   0},
                 (Pair) {(i32)col_rect_w, (i32)statusline_h},
                 *tc_curr_col(tc)
             );
         }
     }
+}
+
+// everything statusline image depends on, to detect changes
+char* statusline_state_dyn(struct Ctx const* ctx) {
+    struct ToolCtx const* tc = &CURR_TC(ctx);
+    if (ctx->input.t == InputT_Console) {
+        struct InputConsoleData const* cl = &ctx->input.d.cl;
+        return str_new(
+            "%u:%.*s\n%s",
+            ctx->dc.width,
+            (i32)arrlen(cl->cmdarr),
+            cl->cmdarr ? cl->cmdarr : "",
+            cl->compls_arr ? cl->compls_arr[cl->compls_curr] : ""
+        );
+    }
+    return str_new(
+        "%u %u %d %u %s %u %08X %u/%td",
+        ctx->dc.width,
+        ctx->curr_tc,
+        ctx->input.t,
+        ctx->input.t == InputT_Color ? ctx->input.d.col.current_digit : 0,
+        tc_get_tool_name(tc),
+        tc->sdata.line_w,
+        tc->sdata.colarr[tc->sdata.curr_col],
+        tc->sdata.curr_col,
+        arrlen(tc->sdata.colarr)
+    );
+}
+
+void update_statusline(struct Ctx* ctx) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct Statusline* sl = &dc->sl;
+    u32 const statusline_h = get_statusline_height(dc);
+
+    if (sl->pm == 0 || sl->w != dc->width || sl->h != statusline_h) {
+        if (sl->pm != 0) {
+            XftDrawDestroy(sl->xft);
+            XFreePixmap(dc->dp, sl->pm);
+        }
+        sl->w = dc->width;
+        sl->h = statusline_h;
+        sl->pm = XCreatePixmap(
+            dc->dp,
+            dc->window,
+            sl->w,
+            sl->h,
+            dc->vinfo.depth
+        );
+        sl->xft = XftDrawCreate(dc->dp, sl->pm, dc->vinfo.visual, dc->colmap);
+        str_free(&sl->state_dyn);
+    }
+
+    char* state_dyn = statusline_state_dyn(ctx);
+    if (sl->state_dyn == NULL || strcmp(sl->state_dyn, state_dyn) != 0) {
+        struct DrawTarget const back = dc->target;
+        dc->target = (struct DrawTarget) {.d = sl->pm, .xft = sl->xft};
+        statusline_render(ctx);
+        dc->target = back;
+        str_free(&sl->state_dyn);
+        sl->state_dyn = state_dyn;
+    } else {
+        str_free(&state_dyn);
+    }
+
+    XCopyArea(
+        dc->dp,
+        sl->pm,
+        dc->back_buffer,
+        dc->screen_gc,
+        0,
+        0,
+        sl->w,
+        sl->h,
+        0,
+        (i32)(dc->height - sl->h)
+    );
 
     XdbeSwapBuffers(
         ctx->dc.dp,
@@ -2565,6 +5484,10 @@ void update_statusline(struct Ctx* ctx) {
 
 // FIXME DRY
 void show_message(struct Ctx* ctx, char const* msg) {
+    // else next frame would overwrite message
+    if (ctx->frame.pending) {
+        redraw_now(ctx);
+    }
     u32 const statusline_h =
         ctx->dc.fnt.xfont->ascent + STATUSLINE.padding_bottom;
     fill_rect(
@@ -2600,6 +5523,32 @@ void show_message_va(struct Ctx* ctx, char const* fmt, ...) {
     va_end(ap);
 }
 
+u64 time_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// render on next frame, after all queued events are handled
+void schedule_redraw(struct Ctx* ctx) {
+    ctx->frame.pending = True;
+}
+
+// for feedback that must not wait for frame period
+void redraw_now(struct Ctx* ctx) {
+    update_screen(ctx);
+    // swap discards what was drawn on window directly
+    ctx->sc.is_shown = False;
+    draw_selection_circle(
+        &ctx->dc,
+        &ctx->sc,
+        ctx->input.prev_c.x,
+        ctx->input.prev_c.y
+    );
+    ctx->frame.pending = False;
+    ctx->frame.last_us = time_us();
+}
+
 struct Ctx ctx_init(Display* dp) {
     return (struct Ctx) {
         .dc =
@@ -2609,12 +5558,24 @@ struct Ctx ctx_init(Display* dp) {
                 .height = CANVAS.default_height,
                 .cv =
                     (struct Canvas) {
-                        .im = NULL,
+                        .rs = {0},
                         .type = IMT_Png,  // save as png by default
                         .zoom = 0,
                         .scroll = {0, 0},
                     },
-                .cache = (struct Cache) {.pm = 0},
+                .cache =
+                    (struct Cache) {
+                        .levels = {{0}},
+                        .dst_pict = 0,
+                        .tile_im = NULL,
+                    },
+                .shm =
+                    (struct Shm) {
+                        .enabled = False,
+                        .completion_ev = NIL,
+                        .put_pending = False,
+                        .staging = NULL,
+                    },
                 .png_compression_level = PNG_DEFAULT_COMPRESSION,
                 .jpg_quality_level = JPG_DEFAULT_QUALITY,
             },
@@ -2624,6 +5585,10 @@ struct Ctx ctx_init(Display* dp) {
         .curr_tc = 0,
         .hist_nextarr = NULL,
         .hist_prevarr = NULL,
+        .hist_budget_mb = HISTORY_BUDGET_MB,
+        .hist_resident = HISTORY_RESIDENT,
+        .spill.fd = -1,
+        .oplog.interval = HISTORY_OPS_INTERVAL,
     };
 }
 
@@ -2631,6 +5596,8 @@ void setup(Display* dp, struct Ctx* ctx) {
     assert(dp);
     assert(ctx);
 
+    blend_init();
+
     /* init arrays */ {
         for (i32 i = 0; i < TCS_NUM; ++i) {
             struct ToolCtx tc = {
@@ -2638,6 +5605,7 @@ void setup(Display* dp, struct Ctx* ctx) {
                 .sdata.curr_col = 0,
                 .sdata.prev_col = 0,
                 .sdata.line_w = TOOLS.default_line_w,
+                .sdata.fill_tol = TOOLS.default_fill_tol,
             };
             arrpush(ctx->tcarr, tc);
             arrpush(ctx->tcarr[i].sdata.colarr, 0xFF000000);
@@ -2652,6 +5620,7 @@ void setup(Display* dp, struct Ctx* ctx) {
         atoms[A_ImagePng] = XInternAtom(dp, "image/png", False);
     }
 
+
     /* xrender */ {
         ctx->dc.xrnd_pic_format =
             XRenderFindStandardFormat(ctx->dc.dp, PictStandardARGB32);
@@ -2666,6 +5635,37 @@ void setup(Display* dp, struct Ctx* ctx) {
 
     ctx->dc.colmap = XCreateColormap(dp, root, ctx->dc.vinfo.visual, AllocNone);
 
+    /* tile upload */ {
+        ctx->dc.cache.tile_im = XCreateImage(
+            dp,
+            ctx->dc.vinfo.visual,
+            ctx->dc.vinfo.depth,
+            ZPixmap,
+            0,
+            NULL,  // points to uploaded tile pixels
+            TILE_SIZE,
+            TILE_SIZE,
+            32,
+            TILE_SIZE * sizeof(argb)
+        );
+        if (XShmQueryExtension(dp)) {
+            ctx->dc.shm.staging = shm_image_new(
+                &ctx->dc,
+                &ctx->dc.shm.seg,
+                TILE_SIZE,
+                TILE_SIZE * SHM_STAGING_TILES
+            );
+        }
+        if (ctx->dc.shm.staging) {
+            assert(
+                ctx->dc.shm.staging->bytes_per_line == TILE_SIZE * sizeof(argb)
+            );
+            ctx->dc.shm.enabled = True;
+            ctx->dc.shm.completion_ev = XShmGetEventBase(dp) + ShmCompletion;
+        }
+        trace("xpaint: MIT-SHM %s", ctx->dc.shm.enabled ? "used" : "unused");
+    }
+
     /* create window */
     ctx->dc.window = XCreateWindow(
         dp,
@@ -2723,6 +5723,15 @@ void setup(Display* dp, struct Ctx* ctx) {
     }
 
     ctx->dc.back_buffer = XdbeAllocateBackBufferName(dp, ctx->dc.window, 0);
+    ctx->dc.target = (struct DrawTarget) {
+        .d = ctx->dc.back_buffer,
+        .xft = XftDrawCreate(
+            dp,
+            ctx->dc.back_buffer,
+            ctx->dc.vinfo.visual,
+            ctx->dc.colmap
+        ),
+    };
 
     /* turn on protocol support */ {
         Atom wm_delete_window = XInternAtom(dp, "WM_DELETE_WINDOW", False);
@@ -2786,35 +5795,18 @@ void setup(Display* dp, struct Ctx* ctx) {
                 die("xpaint: failed to read input file");
             }
         } else {
-            Pixmap data = XCreatePixmap(
-                dp,
-                ctx->dc.window,
-                ctx->dc.width,
-                ctx->dc.height,
-                ctx->dc.vinfo.depth
-            );
-            ctx->dc.cv.im = XGetImage(
-                dp,
-                data,
-                0,
-                0,
-                ctx->dc.width,
-                ctx->dc.height,
-                AllPlanes,
-                ZPixmap
-            );
-            XFreePixmap(dp, data);
+            raster_init(&ctx->dc.cv.rs, ctx->dc.width, ctx->dc.height, 0);
             // initial canvas color
             canvas_fill(ctx, CANVAS.background_argb);
         }
 
         ctx->dc.width = CLAMP(
-            ctx->dc.cv.im->width,
+            ctx->dc.cv.rs.w,
             WINDOW.min_launch_size.x,
             WINDOW.max_launch_size.x
         );
         ctx->dc.height = CLAMP(
-            ctx->dc.cv.im->height + get_statusline_height(&ctx->dc),
+            ctx->dc.cv.rs.h + get_statusline_height(&ctx->dc),
             WINDOW.min_launch_size.y,
             WINDOW.max_launch_size.y
         );
@@ -2824,7 +5816,6 @@ void setup(Display* dp, struct Ctx* ctx) {
     for (i32 i = 0; i < TCS_NUM; ++i) {
         tc_set_tool(&ctx->tcarr[i], Tool_Pencil);
     }
-    history_push(&ctx->hist_prevarr, ctx);
 
     /* show up window */
     XMapRaised(dp, ctx->dc.window);
@@ -2847,13 +5838,44 @@ void run(struct Ctx* ctx) {
 
     Bool running = True;
     XEvent event;
+    i32 const xfd = ConnectionNumber(ctx->dc.dp);
+    u64 const frame_period_us = 1000000 / MAX(1, MAX_FPS);
 
     XSync(ctx->dc.dp, False);
-    while (running && !XNextEvent(ctx->dc.dp, &event)) {
+    while (running) {
+        // render only when event queue is drained
+        if (ctx->frame.pending && !XPending(ctx->dc.dp)) {
+            u64 const now = time_us();
+            u64 const next = ctx->frame.last_us + frame_period_us;
+            if (now < next) {
+                // wait for frame time, but keep handling input meanwhile
+                fd_set fds;
+                FD_ZERO(&fds);
+                FD_SET(xfd, &fds);
+                struct timeval timeout = {
+                    .tv_sec = (time_t)((next - now) / 1000000),
+                    .tv_usec = (suseconds_t)((next - now) % 1000000),
+                };
+                if (select(xfd + 1, &fds, NULL, NULL, &timeout) > 0) {
+                    continue;
+                }
+            }
+            redraw_now(ctx);
+            continue;
+        }
+        // maintain history while idle, one small step per pass
+        if (!XPending(ctx->dc.dp) && history_idle_step(ctx)) {
+            continue;
+        }
+        if (XNextEvent(ctx->dc.dp, &event)) {
+            break;
+        }
         if (XFilterEvent(&event, ctx->dc.window)) {
             continue;
         }
-        if (handlers[event.type]) {
+        if (event.type == ctx->dc.shm.completion_ev) {
+            running = shm_completion_hdlr(ctx, &event);
+        } else if (event.type < LASTEvent && handlers[event.type]) {
             running = handlers[event.type](ctx, &event);
         }
     }
@@ -2866,7 +5888,7 @@ Bool button_press_hdlr(struct Ctx* ctx, XEvent* event) {
     }
     if (CURR_TC(ctx).on_press) {
         CURR_TC(ctx).on_press(ctx, e);
-        update_screen(ctx);
+        redraw_now(ctx);
     }
     if (e->button == XRightMouseBtn) {
         sel_circ_init(ctx, e->x, e->y);
@@ -2886,8 +5908,8 @@ Bool button_release_hdlr(struct Ctx* ctx, XEvent* event) {
         if (selected_item != NIL && ctx->sc.items[selected_item].on_select) {
             ctx->sc.items[selected_item].on_select(ctx);
         }
-        sel_circ_free(&ctx->sc);
-        update_screen(ctx);
+        sel_circ_free(ctx->dc.dp, &ctx->sc);
+        schedule_redraw(ctx);
         ctx->input.is_holding = False;
         ctx->input.is_dragging = False;
         return True;  // something selected do nothing else
@@ -2902,12 +5924,17 @@ Bool button_release_hdlr(struct Ctx* ctx, XEvent* event) {
         } else {
             ctx->dc.cv.scroll.y += sign * 10;
         }
-        update_screen(ctx);
+        schedule_redraw(ctx);
     }
 
     if (CURR_TC(ctx).on_release) {
         CURR_TC(ctx).on_release(ctx, e);
-        update_screen(ctx);
+        schedule_redraw(ctx);
+    }
+    // previews end with drag, even if tool changed during it
+    if (ctx->dc.cv.overlay.tiles) {
+        overlay_free(&ctx->dc.cv);
+        schedule_redraw(ctx);
     }
 
     ctx->input.is_holding = False;
@@ -2921,7 +5948,7 @@ Bool destroy_notify_hdlr(struct Ctx* ctx, XEvent* event) {
 }
 
 Bool expose_hdlr(struct Ctx* ctx, XEvent* event) {
-    update_screen(ctx);
+    schedule_redraw(ctx);
     return True;
 }
 
@@ -2980,7 +6007,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                 if (!history_move(ctx, !(e.state & ShiftMask))) {
                     trace("xpaint: can't undo/revert history");
                 }
-                update_screen(ctx);
+                schedule_redraw(ctx);
             }
             HANDLE_KEY_CASE_MASK(ControlMask, XK_c) {
                 if (HAS_SELECTION(&CURR_TC(ctx))) {
@@ -2998,8 +6025,12 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                     if (ctx->sel_buf.im != NULL) {
                         XDestroyImage(ctx->sel_buf.im);
                     }
-                    ctx->sel_buf.im =
-                        XSubImage(ctx->dc.cv.im, x, y, width, height);
+                    ctx->sel_buf.im = raster_to_ximage(
+                        &ctx->dc,
+                        &ctx->dc.cv.rs,
+                        (Pair) {x, y},
+                        (Pair) {(i32)width, (i32)height}
+                    );
                     assert(ctx->sel_buf.im != NULL);
                     assert(
                         ctx->sel_buf.im->width == width
@@ -3036,46 +6067,48 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
             }
             HANDLE_KEY_CASE_MASK_NOT(ControlMask, XK_c) {
                 input_state_set(&ctx->input, InputT_Color);
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             }
             HANDLE_KEY_CASE(XK_x) {
                 tc_set_curr_col_num(&CURR_TC(ctx), CURR_TC(ctx).sdata.prev_col);
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             }
             if (BETWEEN(key_sym, XK_1, XK_9)) {
                 u32 val = key_sym - XK_1;
                 if (val < TCS_NUM) {
                     ctx->curr_tc = val;
-                    update_statusline(ctx);
+                    schedule_redraw(ctx);
                 }
             }
             if (BETWEEN(key_sym, XK_Left, XK_Down) && e.state & ControlMask) {
                 u32 const value = e.state & ShiftMask ? 25 : 5;
+                // history entries can't be applied to canvas of other size
+                history_forward(ctx);
                 canvas_resize(
                     ctx,
-                    (i32)(ctx->dc.cv.im->width
+                    (i32)(ctx->dc.cv.rs.w
                           + (key_sym == XK_Left        ? -value
                                  : key_sym == XK_Right ? value
                                                        : 0)),
-                    (i32)(ctx->dc.cv.im->height
+                    (i32)(ctx->dc.cv.rs.h
                           + (key_sym == XK_Down     ? -value
                                  : key_sym == XK_Up ? value
                                                     : 0))
                 );
-                update_screen(ctx);
+                schedule_redraw(ctx);
             }
             HANDLE_KEY_CASE_MASK(ControlMask, XK_equal) {
                 canvas_change_zoom(&ctx->dc, ctx->input.prev_c, 1);
-                update_screen(ctx);
+                schedule_redraw(ctx);
             }
             HANDLE_KEY_CASE_MASK(ControlMask, XK_minus) {
                 canvas_change_zoom(&ctx->dc, ctx->input.prev_c, -1);
-                update_screen(ctx);
+                schedule_redraw(ctx);
             }
             // XK_colon not work for some reason
             HANDLE_KEY_CASE_MASK(ShiftMask, XK_semicolon) {
                 input_state_set(&ctx->input, InputT_Console);
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             }
         } break;
 
@@ -3085,16 +6118,16 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                 if (len != MAX_COLORS) {
                     tc_set_curr_col_num(&CURR_TC(ctx), len);
                     arrpush(CURR_TC(ctx).sdata.colarr, 0xFF000000);
-                    update_statusline(ctx);
+                    schedule_redraw(ctx);
                 }
             }
             HANDLE_KEY_CASE(XK_Right) {
                 to_next_input_digit(&ctx->input, True);
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             }
             HANDLE_KEY_CASE(XK_Left) {
                 to_next_input_digit(&ctx->input, False);
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             }
             // change selected color digit with pressed key
             if (strlen(lookup_buf) == 1) {
@@ -3110,7 +6143,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                     *tc_curr_col(&CURR_TC(ctx)) &= ~(0xF << shift);  // clear
                     *tc_curr_col(&CURR_TC(ctx)) |= val << shift;  // set
                     to_next_input_digit(&ctx->input, True);
-                    update_statusline(ctx);
+                    schedule_redraw(ctx);
                 }
             }
         } break;
@@ -3125,7 +6158,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                         ++compl ;
                     }
                     cl_compls_free(cl);
-                    update_statusline(ctx);
+                    schedule_redraw(ctx);
                 } else {  // apply command
                     char* cmd_dyn = cl_cmd_get_str_dyn(cl);
                     input_state_set(&ctx->input, InputT_Interact);
@@ -3136,7 +6169,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                         case ClCPrs_Ok: {
                             struct ClCommand* cmd = &res.d.ok;
                             ClCPrcResult res = cl_cmd_process(ctx, cmd);
-                            update_screen(ctx);
+                            redraw_now(ctx);
                             if (res.bit_status & ClCPrc_Msg) {
                                 show_message(ctx, res.msg_dyn);
                                 str_free(&res.msg_dyn);  // XXX member free
@@ -3184,10 +6217,10 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                         cl->compls_curr = (cl->compls_curr + 1) % max;
                     }
                 }
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             } else if (key_sym == XK_BackSpace) {
                 cl_pop(cl);
-                update_statusline(ctx);
+                schedule_redraw(ctx);
             } else if (key_sym != XK_Escape) {
                 if ((lookup_status == XLookupBoth
                      || lookup_status == XLookupChars)
@@ -3195,7 +6228,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                     for (i32 i = 0; i < text_len; ++i) {
                         cl_push(cl, (char)(lookup_buf[i] & 0xFF));
                     }
-                    update_statusline(ctx);
+                    schedule_redraw(ctx);
                 }
             }
         } break;
@@ -3216,7 +6249,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
                 (CURR_TC(ctx).sdata.curr_col + (key_sym == XK_Up ? 1 : -1))
                     % col_num
             );
-            update_statusline(ctx);
+            schedule_redraw(ctx);
         }
         HANDLE_KEY_CASE_MASK(ControlMask, XK_s) {  // save to current file
             if (save_file(&ctx->dc, ctx->dc.cv.type, ctx->fout.path_dyn)) {
@@ -3229,7 +6262,7 @@ Bool key_press_hdlr(struct Ctx* ctx, XEvent* event) {
     // independent
     HANDLE_KEY_CASE(XK_Escape) {
         input_state_set(&ctx->input, InputT_Interact);
-        update_statusline(ctx);
+        schedule_redraw(ctx);
     }
     HANDLE_KEY_END()
 
@@ -3257,19 +6290,19 @@ Bool motion_notify_hdlr(struct Ctx* ctx, XEvent* event) {
                 >= DRAG_PERIOD_US) {
                 CURR_TC(ctx).on_drag(ctx, e);
                 ctx->input.last_proc_drag_ev_us = current_time.tv_usec;
-                update_screen(ctx);
+                schedule_redraw(ctx);
             }
         }
         if (ctx->input.holding_button == XMiddleMouseBtn) {
             ctx->dc.cv.scroll.x += e->x - ctx->input.prev_c.x;
             ctx->dc.cv.scroll.y += e->y - ctx->input.prev_c.y;
-            update_screen(ctx);
+            schedule_redraw(ctx);
         }
     } else {
         if (CURR_TC(ctx).on_move) {
             CURR_TC(ctx).on_move(ctx, e);
             ctx->input.last_proc_drag_ev_us = 0;
-            update_screen(ctx);
+            schedule_redraw(ctx);
         }
     }
 
@@ -3420,6 +6453,11 @@ Bool client_message_hdlr(struct Ctx* ctx, XEvent* event) {
     return False;
 }
 
+Bool shm_completion_hdlr(struct Ctx* ctx, XEvent* event) {
+    ctx->dc.shm.put_pending = False;
+    return True;
+}
+
 void cleanup(struct Ctx* ctx) {
     /* global */ {
         for (u32 i = 0; i < I_Last; ++i) {
@@ -3428,6 +6466,8 @@ void cleanup(struct Ctx* ctx) {
             }
         }
     }
+    stamp_free(&ctx->stamp);
+    stroke_free(&ctx->stroke);
     /* file paths */ {
         file_ctx_free(&ctx->fout);
         file_ctx_free(&ctx->finp);
@@ -3438,8 +6478,11 @@ void cleanup(struct Ctx* ctx) {
         }
     }
     /* History */ {
-        historyarr_clear(ctx->dc.dp, &ctx->hist_nextarr);
-        historyarr_clear(ctx->dc.dp, &ctx->hist_prevarr);
+        history_commit(ctx);
+        historyarr_clear(&ctx->spill, &ctx->hist_nextarr);
+        historyarr_clear(&ctx->spill, &ctx->hist_prevarr);
+        spill_close(&ctx->spill);
+        oplog_clear(&ctx->oplog);
     }
     /* ToolCtx */ {
         for (i32 i = 0; i < TCS_NUM; ++i) {
@@ -3454,8 +6497,29 @@ void cleanup(struct Ctx* ctx) {
     }
     /* DrawCtx */ {
         /* Cache */ {
-            if (ctx->dc.cache.pm != 0) {
-                XFreePixmap(ctx->dc.dp, ctx->dc.cache.pm);
+            if (ctx->dc.cache.tile_im != NULL) {
+                XDestroyImage(ctx->dc.cache.tile_im);  // data always NULL
+            }
+            if (ctx->dc.shm.staging != NULL) {
+                shm_image_free(
+                    ctx->dc.dp,
+                    ctx->dc.shm.staging,
+                    &ctx->dc.shm.seg
+                );
+            }
+            for (u32 i = 0; i <= MIP_LEVELS; ++i) {
+                struct CacheLevel* cl = i < MIP_LEVELS
+                                          ? &ctx->dc.cache.levels[i]
+                                          : &ctx->dc.cache.overlay;
+                if (cl->src_pict != 0) {
+                    XRenderFreePicture(ctx->dc.dp, cl->src_pict);
+                }
+                if (cl->pm != 0) {
+                    XFreePixmap(ctx->dc.dp, cl->pm);
+                }
+            }
+            if (ctx->dc.cache.dst_pict != 0) {
+                XRenderFreePicture(ctx->dc.dp, ctx->dc.cache.dst_pict);
             }
         }
         /* Scheme */ {  // depends on VisualInfo and Colormap
@@ -3472,8 +6536,17 @@ void cleanup(struct Ctx* ctx) {
             }
             free(ctx->dc.schemes_dyn);
         }
+        /* statusline */ {
+            if (ctx->dc.sl.pm != 0) {
+                XftDrawDestroy(ctx->dc.sl.xft);
+                XFreePixmap(ctx->dc.dp, ctx->dc.sl.pm);
+            }
+            str_free(&ctx->dc.sl.state_dyn);
+        }
+        sel_circ_free(ctx->dc.dp, &ctx->sc);
         fnt_free(ctx->dc.dp, &ctx->dc.fnt);
-        canvas_free(ctx->dc.dp, &ctx->dc.cv);
+        canvas_free(&ctx->dc.cv);
+        XftDrawDestroy(ctx->dc.target.xft);
         XdbeDeallocateBackBufferName(ctx->dc.dp, ctx->dc.back_buffer);
         XFreeGC(ctx->dc.dp, ctx->dc.gc);
         XFreeGC(ctx->dc.dp, ctx->dc.screen_gc);